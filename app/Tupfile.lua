@@ -27,6 +27,7 @@ local SharedClientObjects = Define.Objects
 {
 	Sources = Item()
 		+ 'clientcore.cxx'
+		+ 'engine.cxx'
 }
 
 local WindowsIconRes = Item()
@@ -120,8 +121,8 @@ then
 	}
 
 	local PackageDependencies = PackageDependencies ..
-		(tup.getconfig 'PLATFORM' == 'arch64' and ", 'qt5-base>=5.1.1-1', 'vlc>=2.1.0-3', 'taglib>=1.9.1-1'" or '') ..
-		(tup.getconfig 'PLATFORM' == 'ubuntu' and ', libqt5core5 (>= 5.0.2), libqt5widgets5 (>= 5.0.2), libqt5gui5 (>= 5.0.2), libvlc5 (>= 2.0.8-0), taglib (>= 1.9.1-1)' or '')
+		(tup.getconfig 'PLATFORM' == 'arch64' and ", 'qt5-base>=5.1.1-1', 'vlc>=3.0.0', 'taglib>=1.9.1-1'" or '') ..
+		(tup.getconfig 'PLATFORM' == 'ubuntu' and ', libqt5core5 (>= 5.0.2), libqt5widgets5 (>= 5.0.2), libqt5gui5 (>= 5.0.2), libvlc5 (>= 3.0.0), taglib (>= 1.9.1-1)' or '')
 
 	Package = Define.Package
 	{
@@ -186,8 +187,8 @@ then
 	}
 
 	local PackageDependencies = PackageDependencies ..
-		(tup.getconfig 'PLATFORM' == 'arch64' and ", 'readline>=6.2.004-1', 'vlc>=2.1.0-3', 'taglib>=1.9.1-1'" or '') ..
-		(tup.getconfig 'PLATFORM' == 'ubuntu' and ', readline6 (>= 6.2-9), libvlc5 (>= 2.0.8-0), taglib (>=1.9.1-1)' or '')
+		(tup.getconfig 'PLATFORM' == 'arch64' and ", 'readline>=6.2.004-1', 'vlc>=3.0.0', 'taglib>=1.9.1-1'" or '') ..
+		(tup.getconfig 'PLATFORM' == 'ubuntu' and ', readline6 (>= 6.2-9), libvlc5 (>= 3.0.0), taglib (>=1.9.1-1)' or '')
 	Package = Define.Package
 	{
 		Name = 'raoliocli',
@@ -198,3 +199,28 @@ then
 		Licenses = Item '../license-raolio.txt'
 	}
 end
+
+if tup.getconfig 'TEST' ~= 'false' and tup.getconfig 'PLATFORM' ~= 'windows'
+then
+	local Test = function(Name, Sources, Objects, LinkFlags)
+		local Executable = Define.Executable
+		{
+			Name = Name,
+			Sources = Sources,
+			Objects = Objects,
+			LinkFlags = LinkFlags
+		}
+		Define.Raw
+		{
+			Inputs = Executable,
+			Outputs = Item(Name .. '.log'),
+			Command = './' .. Name .. ' > ' .. Name .. '.log'
+		}
+	end
+
+	Test('testprotocol', Item() + 'testprotocol.cxx', Item(), '')
+	Test('testqueue', Item() + 'testqueue.cxx', SharedObjects, LinkFlags)
+	Test('testtimers', Item() + 'testtimers.cxx', SharedObjects, LinkFlags)
+	Test('testsync', Item() + 'testsync.cxx', SharedObjects + SharedClientObjects, LinkFlags .. VLCLinkFlags .. ' -ltag')
+	Test('testplaylist', Item() + 'testplaylist.cxx', SharedObjects + SharedClientObjects, LinkFlags .. VLCLinkFlags .. ' -ltag')
+end
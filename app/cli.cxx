@@ -2,6 +2,7 @@
 #include "regex.h"
 
 #include <csignal>
+#include <sys/select.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <glob.h>
@@ -96,17 +97,16 @@ std::string FormatItem(PlaylistType::PlaylistInfo const &Item, OptionalT<size_t>
 	return Out;
 }
 
-// Asynch logging and writing to the screen and stuff
+// Asynch logging and writing to the screen and stuff.  SIGALRM is blocked in the main thread except while it waits
+// for input, so a wakeup can't slip in between draining the calls and starting to wait.
 bool Alive = true;
 auto MainThread = pthread_self();
-std::mutex CallsMutex;
-std::vector<std::function<void(void)>> Calls;
+MPSCQueue<CallT> Calls;
+sigset_t WaitMask;
 
-void Async(std::function<void(void)> const &Call)
+void Async(CallT &&Call)
 {
-	std::lock_guard<std::mutex> Lock(CallsMutex);
-	Calls.push_back(Call);
-	pthread_kill(MainThread, SIGALRM);
+	if (Calls.Push(std::move(Call))) pthread_kill(MainThread, SIGALRM);
 }
 
 // Because readline >8=(           )
@@ -119,6 +119,12 @@ int main(int argc, char **argv)
 		SignalAction.sa_handler = [](int) {};
 		sigaction(SIGALRM, &SignalAction, nullptr);
 		sigaction(SIGINT, &SignalAction, nullptr);
+
+		sigset_t Alarm;
+		sigemptyset(&Alarm);
+		sigaddset(&Alarm, SIGALRM);
+		pthread_sigmask(SIG_BLOCK, &Alarm, &WaitMask);
+		sigdelset(&WaitMask, SIGALRM);
 	}
 
 	InitializeTranslation("raoliocli");
@@ -149,16 +155,18 @@ int main(int argc, char **argv)
 	} Volition;
 	struct CLIPlaylistType : PlaylistType
 	{
-		void Reverse(void) { std::reverse(Playlist.begin(), Playlist.end()); }
+		void Reverse(void)
+		{
+			auto const CurrentID = GetCurrentID();
+			std::reverse(Playlist.begin(), Playlist.end());
+			Reindex(CurrentID);
+			LocalOrder = true;
+		}
 		void Sink(HashT const &Hash)
 		{
-			auto Found = Playlist.begin();
-			for (; Found != Playlist.end(); ++Found)
-				if (Found->Hash == Hash) break;
-			if (Found == Playlist.end()) return;
-			auto Copy = *Found;
-			Playlist.erase(Found);
-			Playlist.push_back(std::move(Copy));
+			auto Found = Find(Hash);
+			if (!Found) return;
+			Move(*Found, 1, Playlist.size());
 		}
 	} Playlist;
 
@@ -171,13 +179,14 @@ int main(int argc, char **argv)
 		unsigned int Minutes = Time / 60;
 		std::cout << Local("Time: ^0:^1", Minutes, StringT() << std::setfill('0') << std::setw(2) << ((unsigned int)Time - (Minutes * 60))) << "\n";
 	}); };
-	Core.AddCallback = [&](MediaInfo Item) { Async([&, Item](void) { Playlist.AddUpdate(Item); }); };
+	Playlist.ReorderCallback = [&](std::vector<OrderPosition> const &Positions) { Core.Reorder(Positions); };
+	Core.AddUpdateCallback = [&](std::vector<MediaInfo> Items) { Async([&, Items](void) { Playlist.AddUpdate(Items); }); };
 	Core.RemoveCallback = [&](HashT const &MediaID) { Async([&, MediaID](void) { Playlist.Remove(MediaID); }); };
-	Core.UpdateCallback = [&](MediaInfo Item) { Async([&, Item](void) { Playlist.AddUpdate(Item); }); };
 	Core.SelectCallback = [&](HashT const &MediaID) { Async([&, MediaID](void)
 	{
 		Volition.Ack();
 		bool WasSame = Playlist.Select(MediaID);
+		Core.Prioritize(Playlist.GetUpcomingIDs(3));
 		auto Playing = Playlist.GetCurrent();
 		Assert(Playing);
 		if (!WasSame)
@@ -196,6 +205,17 @@ int main(int argc, char **argv)
 			Core.Play(*NextID, 0ul);
 		});
 	};
+	Core.EndingCallback = [&](void)
+	{
+		Async([&](void)
+		{
+			if (!Volition.InControl()) return;
+			auto NextID = Playlist.GetNextID();
+			if (!NextID) return;
+			Volition.Request();
+			Core.PlayNext(*NextID);
+		});
+	};
 
 	std::cout << Local("Connecting to ^0:^1", Host, Port) << std::endl;
 	Core.Open(false, Host, Port);
@@ -309,6 +329,19 @@ int main(int argc, char **argv)
 		}
 	};
 	Commands["ls"] = Commands["list"];
+	Commands["find"] =
+	{
+		"-find TEXT\t" + Local("Lists media whose artist, album or title contains every word in TEXT.") + "\n",
+		[&](std::string const &Line)
+		{
+			auto const Rows = Playlist.Search(Line);
+			if (Rows.empty()) { std::cout << Local("No matches.") << "\n"; return; }
+			auto const &Items = Playlist.GetItems();
+			for (auto const Row : Rows)
+				std::cout << FormatItem(Items[Row], Row, true, true, true, true) << "\n";
+		}
+	};
+	Commands["search"] = Commands["find"];
 	Commands["sort"] =
 	{
 		"-sort [-][artist|album|track|title]...\n"
@@ -350,6 +383,23 @@ int main(int argc, char **argv)
 			Commands["list"].Function("-a");
 		}
 	};
+	Commands["share"] =
+	{
+		"-share\t" + Local("Makes the current playlist order everyone's; sorting, shuffling and reversing only change yours until then.") + "\n",
+		[&](std::string const &Line)
+		{
+			Playlist.ShareOrder();
+		}
+	};
+	Commands["unshare"] =
+	{
+		"-unshare\t" + Local("Goes back to the shared playlist order.") + "\n",
+		[&](std::string const &Line)
+		{
+			Playlist.UnshareOrder();
+			Commands["list"].Function("-a");
+		}
+	};
 	Commands["sink"] =
 	{
 		"-sink INDEX\t" + Local("Moves INDEX to the bottom of the playlist.") + "\n",
@@ -562,18 +612,18 @@ int main(int argc, char **argv)
 			rl_replace_line("", 0);
 			rl_redisplay();
 
-			{
-				std::lock_guard<std::mutex> Lock(CallsMutex);
-				for (auto const &Call : Calls) Call();
-				Calls.clear();
-			}
+			Calls.Drain([](CallT &Call) { Call(); });
 
 			rl_set_prompt(Handle.c_str());
 			rl_replace_line(saved_line, 0);
 			rl_point = saved_point;
 			rl_redisplay();
 
-			Result = read(fileno(File), &Out, 1);
+			fd_set Ready;
+			FD_ZERO(&Ready);
+			FD_SET(fileno(File), &Ready);
+			Result = pselect(fileno(File) + 1, &Ready, nullptr, nullptr, nullptr, &WaitMask);
+			if (Result == 1) Result = read(fileno(File), &Out, 1);
 		} while (Alive && (Result == -1) && (errno == EINTR));
 		if (Result != 1) Out = EOF;
 		return Out;
@@ -3,30 +3,112 @@
 #include "../ren-cxx-basics/type.h"
 
 #include <taglib/fileref.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <numeric>
+#include <locale>
+#include <limits>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
 
-EngineWrapper::EngineWrapper(void)
+void LatencyTracker::Add(uint64_t Instance, uint64_t Sent)
 {
-	VLC = libvlc_new(0, nullptr);
-	if (!VLC) throw ConstructionErrorT() << Local("Could not initialize libVLC: ^0", libvlc_errmsg());
-	VLCMediaPlayer = libvlc_media_player_new(VLC);
-	if (!VLCMediaPlayer) throw ConstructionErrorT() << Local("Could not initialice libVLC media player: ^0", libvlc_errmsg());
+	auto const Now = GetNow();
+	auto &Samples = Instances[Instance];
+	Samples.LastSeen = Now;
+	Samples.Transit.push_back(Sent > Now ? 0 : Now - Sent); // Negative samples are estimation error, the transit was ~0
+	if (Samples.Transit.size() > 16) Samples.Transit.pop_front();
+
+	for (auto Other = Instances.begin(); Other != Instances.end();)
+	{
+		if (Now - Other->second.LastSeen > 60 * 1000) Other = Instances.erase(Other);
+		else ++Other;
+	}
 }
 
-EngineWrapper::~EngineWrapper(void)
+uint64_t LatencyTracker::Expected(void) const
 {
-	libvlc_media_player_release(VLCMediaPlayer);
-	libvlc_release(VLC);
+	// 90th percentile of recent transit times to the slowest instance, plus the spread between that and the median
+	// to cover jitter.  Single spikes age out instead of inflating the start delay forever.
+	uint64_t Out = 0;
+	for (auto const &Instance : Instances)
+	{
+		std::vector<uint64_t> Sorted(Instance.second.Transit.begin(), Instance.second.Transit.end());
+		if (Sorted.empty()) continue;
+		std::sort(Sorted.begin(), Sorted.end());
+		auto const Median = Sorted[Sorted.size() / 2];
+		auto const High = Sorted[(Sorted.size() * 9) / 10];
+		Out = std::max(Out, High + (High - Median));
+	}
+	return Out;
 }
 
-MediaItem::MediaItem(HashT const &Hash, PathT const &Filename, OptionalT<uint16_t> const &Track, std::string const &Artist, std::string const &Album, std::string const &Title, libvlc_media_t *VLCMedia) : MediaInfo{Hash, Filename, Track, Artist, Album, Title}, VLCMedia{VLCMedia} {}
+constexpr int64_t DriftCorrector::Target;
+constexpr int64_t DriftCorrector::SeekThreshold;
+constexpr float DriftCorrector::Window;
+constexpr float DriftCorrector::MaxAdjustment;
 
-MediaItem::~MediaItem(void) { libvlc_media_release(VLCMedia); }
+constexpr uint64_t ClientCore::HandoffLead;
 
-ClientCore::ClientCore(float Volume) : CallTransfer(Parent), Parent{false}, Playing{nullptr}, LastPosition{0}
+void DriftCorrector::Reset(void)
 {
-	libvlc_event_attach(libvlc_media_player_event_manager(Engine.VLCMediaPlayer), libvlc_MediaPlayerEndReached, VLCMediaEndCallback, this);
-	libvlc_audio_set_volume(Engine.VLCMediaPlayer, static_cast<int>(Volume * 100));
-	libvlc_audio_set_volume(Engine.VLCMediaPlayer, static_cast<int>(Volume * 100));
+	Errors.clear();
+	Rate = 1;
+}
+
+OptionalT<float> DriftCorrector::Correct(int64_t Error)
+{
+	if ((Error > SeekThreshold) || (Error < -SeekThreshold))
+	{
+		Reset();
+		return {};
+	}
+
+	// The player's reported time is jittery, so work from the median of the last few samples.  Only samples since the
+	// rate last changed count, since earlier ones were measured before that correction took effect.
+	Errors.push_back(Error);
+	if (Errors.size() > 3) Errors.pop_front();
+	std::vector<int64_t> Sorted(Errors.begin(), Errors.end());
+	std::sort(Sorted.begin(), Sorted.end());
+	auto const Median = Sorted[Sorted.size() / 2];
+
+	// Left alone within half the target, so the median lagging behind skew doesn't carry it past the target
+	auto NewRate = 1.0f;
+	if ((Median > Target / 2) || (Median < -Target / 2))
+		NewRate = 1.0f - std::max(-MaxAdjustment, std::min(MaxAdjustment, Median / Window));
+	if (NewRate != Rate) Errors.clear();
+	Rate = NewRate;
+	return Rate;
+}
+
+MediaItem::MediaItem(HashT const &Hash, PathT const &Filename, OptionalT<uint16_t> const &Track, std::string const &Artist, std::string const &Album, std::string const &Title, std::unique_ptr<AudioEngine::Media> &&EngineMedia) : MediaInfo{Hash, Filename, Track, Artist, Album, Title}, EngineMedia{std::move(EngineMedia)} {}
+
+static void ApplyTags(MediaInfo &Item, MediaTags const &Tags)
+{
+	if (Tags.Track > 0) Item.Track = Tags.Track;
+	if (!Tags.Artist.empty()) Item.Artist = Tags.Artist;
+	if (!Tags.Album.empty()) Item.Album = Tags.Album;
+	if (!Tags.Title.empty()) Item.Title = Tags.Title;
+	if (Tags.Duration > 0) Item.Duration = Tags.Duration;
+}
+
+ClientCore::ClientCore(float Volume, EngineType Type) : ClientCore(Volume, [Type](CallTransferType &CallTransfer) { return CreateEngine(Type, CallTransfer); }) {}
+
+ClientCore::ClientCore(float Volume, std::function<std::unique_ptr<AudioEngine>(CallTransferType &CallTransfer)> const &MakeEngine) : CallTransfer(Parent), Parent{false}, Engine{MakeEngine(Parent)}, SaveTimer{0, 0}, Playing{nullptr}, LastPosition{0}, Preroll{false, nullptr, MediaTimeT{0}, 0, {0, 0}}, EndingSent{false}, SyncTimer{0, 0}, TagWorkers{2}
+{
+	Engine->SetVolume(Volume);
+	Engine->EndCallback = [this](void)
+	{
+		if (Preroll.Active) return; // Already handing off to the next item
+		if (EndCallback) EndCallback();
+	};
+	Engine->PrerolledCallback = [this](void)
+	{
+		auto const Now = GetNow();
+		if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("Prerolled media, ^0ms before start", Preroll.SystemTime > Now ? Preroll.SystemTime - Now : 0));
+	};
 
 	Parent.LogCallback = [this](Core::LogPriority Priority, std::string const &Message)
 	{
@@ -41,10 +123,20 @@ ClientCore::ClientCore(float Volume) : CallTransfer(Parent), Parent{false}, Play
 		{ AddInternal(Hash, Filename, DefaultTitle); };
 	Parent.RemoveCallback = [this](HashT const &Hash)
 		{ RemoveInternal(Hash); };
+	Parent.ReceivingCallback = [this](HashT const &Hash, PathT const &Filename, uint64_t Size, std::string const &DefaultTitle)
+		{ ReceivingInternal(Hash, Filename, Size, DefaultTitle); };
+	Parent.ProgressCallback = [this](HashT const &Hash, uint64_t Available)
+		{ ProgressInternal(Hash, Available); };
+	Parent.TagsCallback = [this](HashT const &Hash, MediaTags const &Tags)
+		{ TagsInternal(Hash, Tags); };
+	Parent.OrderCallback = [this](HashT const &Hash, std::string const &Position)
+		{ OrderInternal(Hash, Position); };
 	Parent.ClockCallback = [this](uint64_t InstanceID, uint64_t const &SystemTime)
 		{ Latencies.Add(InstanceID, SystemTime); };
 	Parent.PlayCallback = [this](HashT const &MediaID, MediaTimeT MediaTime, uint64_t const &SystemTime)
 		{ auto const Now = GetNow(); PlayInternal(MediaID, MediaTime, SystemTime, Now); };
+	Parent.PositionCallback = [this](uint64_t InstanceID, HashT const &MediaID, MediaTimeT MediaTime, uint64_t const &SystemTime)
+		{ PositionInternal(InstanceID, MediaID, MediaTime, SystemTime); };
 	Parent.StopCallback = [this](void)
 		{ StopInternal(); };
 }
@@ -52,15 +144,25 @@ ClientCore::ClientCore(float Volume) : CallTransfer(Parent), Parent{false}, Play
 void ClientCore::Open(bool Listen, std::string const &Host, uint16_t Port)
 	{ Parent.Open(Listen, Host, Port); }
 
+static OptionalT<std::pair<uint64_t, int64_t>> StatFile(PathT const &Path)
+{
+	struct stat Info;
+	if (stat(Path->Render().c_str(), &Info) != 0) return {};
+	return std::make_pair(static_cast<uint64_t>(Info.st_size), static_cast<int64_t>(Info.st_mtime));
+}
+
 void ClientCore::Add(HashT const &Hash, size_t Size, PathT const &Filename)
 {
 	CallTransfer([=](void)
 	{
-		Parent.Add(Hash, Size, Filename);
-		AddInternal(Hash, Filename, Filename->Filename());
+		auto const Stat = StatFile(Filename);
+		AddLocalInternal(Hash, Size, Stat ? Stat->second : 0, Filename);
 	});
 }
 
+void ClientCore::Restore(PathT const &Path)
+	{ CallTransfer([=](void) { RestoreInternal(Path); }); }
+
 void ClientCore::Remove(HashT const &Hash)
 {
 	CallTransfer([=](void)
@@ -88,7 +190,7 @@ void ClientCore::GetTime(void)
 	{
 		if (SeekCallback)
 		{
-			float Duration = Playing ? libvlc_media_get_duration(Playing->VLCMedia) / 1000.0f : 0.0f;
+			float Duration = Playing ? *GetDurationInternal(*Playing) / 1000.0f : 0.0f;
 			SeekCallback(GetTimeInternal(), Duration);
 		}
 	});
@@ -103,7 +205,7 @@ void ClientCore::Play(HashT const &MediaID, float Position)
 	{
 		auto Media = MediaLookup.find(MediaID);
 		if (Media == MediaLookup.end()) return;
-		MediaTimeT TotalLength{libvlc_media_get_duration(Media->second->VLCMedia)};
+		auto const TotalLength = GetDurationInternal(*Media->second);
 		LocalPlayInternal(MediaID, MediaTimeT(Position * StrictCast(TotalLength, float)));
 		LastPosition = MediaTimePercentT{Position};
 	});
@@ -114,11 +216,43 @@ void ClientCore::Play(void)
 	CallTransfer([&](void)
 	{
 		if (!Playing) return;
-		MediaTimeT Position{libvlc_media_player_get_time(Engine.VLCMediaPlayer)};
-		LocalPlayInternal(Playing->Hash, Position);
+		auto const Position = Engine->GetTime();
+		LocalPlayInternal(Playing->Hash, Position ? *Position : MediaTimeT(0));
 	});
 }
 
+void ClientCore::PlayNext(HashT const &MediaID)
+{
+	CallTransfer([=](void)
+	{
+		auto const &Status = Parent.GetPlayStatus();
+		if (!Status.Playing || !Playing || (Playing->Hash != Status.MediaID))
+		{
+			LocalPlayInternal(MediaID, MediaTimeT(0));
+			return;
+		}
+		auto const Duration = GetDurationInternal(*Playing);
+		if ((*Duration == 0) || (*Duration < *Status.MediaTime))
+		{
+			LocalPlayInternal(MediaID, MediaTimeT(0));
+			return;
+		}
+
+		// Start everywhere exactly when the current item ends on the agreed timeline, or as soon as every instance
+		// can hear about it if that's too late
+		auto const Now = GetNow();
+		auto const Start = std::max(Status.SystemTime + (*Duration - *Status.MediaTime), Now + Latencies.Expected());
+		Parent.Play(MediaID, MediaTimeT(0), Start);
+		PlayInternal(MediaID, MediaTimeT(0), Start, Now);
+	});
+}
+
+void ClientCore::Prioritize(std::vector<HashT> const &MediaIDs)
+	{ CallTransfer([=](void) { Parent.Prioritize(MediaIDs); }); }
+
+void ClientCore::Reorder(std::vector<OrderPosition> const &Positions)
+	{ CallTransfer([=](void) { Parent.Reorder(Positions); }); }
+
 void ClientCore::Stop(void)
 	{ CallTransfer([&](void) { if (!Playing) return; LocalStopInternal(); }); }
 
@@ -127,63 +261,454 @@ void ClientCore::Chat(std::string const &Message)
 	CallTransfer([=](void) { Parent.Chat(Message); });
 }
 
-struct VLCParsedUserData
+void ClientCore::AddLocalInternal(HashT const &Hash, uint64_t Size, int64_t ModifiedTime, PathT const &Filename)
 {
-	VLCParsedUserData(ClientCore &Core, HashT const &Hash) : Core(Core), Hash(Hash) {}
-	ClientCore &Core;
-	HashT Hash;
+	Parent.Add(Hash, Size, Filename);
+	AddInternal(Hash, Filename, Filename->Filename());
+	auto Found = MediaLookup.find(Hash);
+	if (Found == MediaLookup.end()) return;
+	Found->second->Size = Size;
+	Found->second->ModifiedTime = ModifiedTime;
+	SnapshotChangedInternal();
+}
+
+// Snapshot layout, all in native byte order:
+// magic, entry count, then per entry: hash, size, modified time, track, duration, path, artist, album, title and
+// shared position.  Strings are a uint32_t length then the bytes.
+static uint64_t const SnapshotMagic = 0x31534F494C4F4152; // "RAOLIOS1" in little endian
+
+struct SnapshotWriter
+{
+	std::vector<uint8_t> Out;
+
+	template <typename ValueType> void Write(ValueType const &Value)
+	{
+		auto const Start = Out.size();
+		Out.resize(Start + sizeof(Value));
+		std::memcpy(&Out[Start], &Value, sizeof(Value));
+	}
+
+	void Write(std::string const &Value)
+	{
+		Write(static_cast<uint32_t>(Value.size()));
+		Out.insert(Out.end(), Value.begin(), Value.end());
+	}
 };
 
-void ClientCore::AddInternal(HashT const &Hash, PathT const &Filename, std::string const &DefaultTitle)
+struct SnapshotReader
 {
-	if (MediaLookup.find(Hash) != MediaLookup.end()) return;
-	auto *VLCMedia = libvlc_media_new_path(Engine.VLC, Filename->Render().c_str());
-	if (!VLCMedia)
+	std::vector<uint8_t> const &In;
+	size_t Offset;
+	bool Failed;
+
+	SnapshotReader(std::vector<uint8_t> const &In) : In(In), Offset{0}, Failed{false} {}
+
+	template <typename ValueType> ValueType Read(void)
 	{
-		if (LogCallback) LogCallback(Local("Failed to open selected media, ^0: ^1", Filename, libvlc_errmsg()));
-		return;
+		ValueType Out{};
+		if (Failed || (In.size() - Offset < sizeof(Out))) { Failed = true; return Out; }
+		std::memcpy(&Out, &In[Offset], sizeof(Out));
+		Offset += sizeof(Out);
+		return Out;
 	}
 
-	auto Item = new MediaItem{Hash, Filename, {}, {}, {}, DefaultTitle, VLCMedia};
-	MediaLookup[Hash] = std::unique_ptr<MediaItem>(Item);
+	std::string ReadString(void)
+	{
+		auto const Length = Read<uint32_t>();
+		if (Failed || (In.size() - Offset < Length)) { Failed = true; return {}; }
+		std::string Out(reinterpret_cast<char const *>(&In[Offset]), Length);
+		Offset += Length;
+		return Out;
+	}
+};
 
+void ClientCore::RestoreInternal(PathT const &Path)
+{
+	SnapshotPath = Path;
+
+	std::vector<uint8_t> Data;
 	{
-		TagLib::FileRef TagFile(Filename->Render().c_str());
-		auto Tags = TagFile.tag();
-		if (Tags)
+		auto File = Filesystem::fopen_read(Path->Render());
+		if (!File) return; // Nothing saved yet
+		if (fseek(File, 0, SEEK_END) == 0)
 		{
-			auto Title = Tags->title();
-			if (!Title.isEmpty()) Item->Title = Title.to8Bit(true);
-			auto Artist = Tags->artist();
-			if (!Artist.isEmpty()) Item->Artist = Artist.to8Bit(true);
-			auto Album = Tags->album();
-			if (!Album.isEmpty()) Item->Album = Album.to8Bit(true);
-			auto Track = Tags->track();
-			if (Track > 0) Item->Track = Track;
+			auto const Size = ftell(File);
+			if ((Size > 0) && (fseek(File, 0, SEEK_SET) == 0))
+			{
+				Data.resize(static_cast<size_t>(Size));
+				if (fread(&Data[0], 1, Data.size(), File) != Data.size()) Data.clear();
+			}
 		}
+		fclose(File);
 	}
 
-	if (AddCallback) AddCallback(*Item);
+	SnapshotReader Reader{Data};
+	if (Reader.Read<uint64_t>() != SnapshotMagic)
+	{
+		if (LogCallback) LogCallback(Local("Ignoring unreadable library snapshot ^0", Path));
+		return;
+	}
+	auto const Count = Reader.Read<uint32_t>();
+
+	struct CheckInfo
+	{
+		HashT Hash;
+		PathT Filename;
+		uint64_t Size;
+		int64_t ModifiedTime;
+	};
+	std::vector<CheckInfo> Checks;
+	std::vector<OrderPosition> Positions;
+	for (uint32_t Index = 0; Index < Count; ++Index)
+	{
+		auto const Hash = Reader.Read<HashT>();
+		auto const Size = Reader.Read<uint64_t>();
+		auto const ModifiedTime = Reader.Read<int64_t>();
+		MediaTags Tags;
+		Tags.Track = Reader.Read<uint16_t>();
+		Tags.Duration = Reader.Read<uint64_t>();
+		auto const Filename = Reader.ReadString();
+		Tags.Artist = Reader.ReadString();
+		Tags.Album = Reader.ReadString();
+		Tags.Title = Reader.ReadString();
+		auto const Position = Reader.ReadString();
+		if (Reader.Failed)
+		{
+			if (LogCallback) LogCallback(Local("Library snapshot ^0 is truncated", Path));
+			break;
+		}
+		if (MediaLookup.find(Hash) != MediaLookup.end()) continue;
+
+		// Nothing per item that touches the disk or the network here: engine media is opened when it's first
+		// played, and tags and positions go out paced with each connection's announcements rather than as a
+		// broadcast per item.  The position has the oldest possible stamp, so where peers have moved it since wins.
+		auto const Qualified = PathT::Qualify(Filename);
+		Parent.Restore(Hash, Tags, Position);
+		Parent.Add(Hash, Size, Qualified);
+		auto Item = std::make_unique<MediaItem>(Hash, Qualified, OptionalT<uint16_t>{}, std::string{}, std::string{}, Qualified->Filename(), nullptr);
+		ApplyTags(*Item, Tags);
+		Item->Tagged = true;
+		Item->Size = Size;
+		Item->ModifiedTime = ModifiedTime;
+		InsertInternal(std::move(Item));
+		Checks.push_back({Hash, Qualified, Size, ModifiedTime});
+	}
+	if (LogCallback) LogCallback(Local("Restored ^0 media from ^1", Checks.size(), Path));
+
+	// Check the files in the background, a batch at a time so tag parsing for new media isn't held up for long
+	size_t const BatchSize = 256;
+	for (size_t Start = 0; Start < Checks.size(); Start += BatchSize)
+	{
+		std::vector<CheckInfo> Batch(Checks.begin() + Start, Checks.begin() + std::min(Start + BatchSize, Checks.size()));
+		TagWorkers.Queue([this, Batch](void)
+		{
+			for (auto const &Check : Batch)
+			{
+				auto const Stat = StatFile(Check.Filename);
+				if (Stat && (Stat->first == Check.Size) && (Stat->second == Check.ModifiedTime)) continue;
+				auto const Rehashed = Stat ? HashFile(Check.Filename) : OptionalT<std::pair<HashT, size_t>>{};
+				auto const ModifiedTime = Stat ? Stat->second : 0;
+				CallTransfer([this, Check, Rehashed, ModifiedTime](void)
+				{
+					auto Found = MediaLookup.find(Check.Hash);
+					if ((Found == MediaLookup.end()) || (Found->second->Filename != Check.Filename)) return;
+					if (LogCallback) LogCallback(Local("^0 changed since it was added", Check.Filename));
+					Parent.Remove(Check.Hash);
+					RemoveInternal(Check.Hash);
+					if (Rehashed) AddLocalInternal(Rehashed->first, Rehashed->second, ModifiedTime, Check.Filename);
+				});
+			}
+		});
+	}
+}
 
+void ClientCore::SnapshotChangedInternal(void)
+{
+	if (!SnapshotPath || Parent.Pending(SaveTimer)) return;
+	SaveTimer = Parent.Schedule(SaveDelay, [this](void) { SaveInternal(); });
+}
+
+void ClientCore::SaveInternal(void)
+{
+	if (!SnapshotPath) return;
+
+	SnapshotWriter Writer;
+	Writer.Write(SnapshotMagic);
+	uint32_t Count = 0;
+	for (auto const &Pair : MediaLookup) if (Pair.second->Size != 0) ++Count;
+	Writer.Write(Count);
+	for (auto const &Pair : MediaLookup)
+	{
+		auto const &Item = *Pair.second;
+		if (Item.Size == 0) continue;
+		Writer.Write(Item.Hash);
+		Writer.Write(Item.Size);
+		Writer.Write(Item.ModifiedTime);
+		Writer.Write(static_cast<uint16_t>(Item.Track ? *Item.Track : 0));
+		Writer.Write(Item.Duration);
+		Writer.Write(Item.Filename->Render());
+		Writer.Write(Item.Artist);
+		Writer.Write(Item.Album);
+		Writer.Write(Item.Title);
+		Writer.Write(Parent.GetPosition(Item.Hash));
+	}
+
+	// Written beside and moved over, so a crash mid-write leaves the last snapshot intact
+	auto const Final = (*SnapshotPath)->Render();
+	auto const Temporary = Final + ".new";
+	auto File = Filesystem::fopen_write(Temporary);
+	if (!File)
+	{
+		if (LogCallback) LogCallback(Local("Couldn't save library snapshot to ^0", Temporary));
+		return;
+	}
+	bool const Wrote = fwrite(&Writer.Out[0], 1, Writer.Out.size(), File) == Writer.Out.size();
+	fclose(File);
+	if (!Wrote)
+	{
+		if (LogCallback) LogCallback(Local("Couldn't save library snapshot to ^0", Temporary));
+		std::remove(Temporary.c_str());
+		return;
+	}
+	std::remove(Final.c_str()); // Windows won't rename over an existing file
+	std::rename(Temporary.c_str(), Final.c_str());
+}
+
+void ClientCore::AddInternal(HashT const &Hash, PathT const &Filename, std::string const &DefaultTitle)
+{
+	auto Found = MediaLookup.find(Hash);
+	if (Found != MediaLookup.end())
+	{
+		// Finished arriving
+		auto &Item = *Found->second;
+		if (!Item.Receiving) return;
+		Item.Receiving->SetAvailable(Item.Receiving->GetSize());
+		Item.Receiving.reset();
+		if (!Item.Tagged) ParseTagsInternal(Hash, Filename);
+		return;
+	}
+
+	auto EngineMedia = Engine->Open(Filename);
+	if (!EngineMedia)
+	{
+		if (LogCallback) LogCallback(Local("Failed to open selected media, ^0: ^1", Filename, Engine->GetError()));
+		return;
+	}
+	InsertInternal(std::make_unique<MediaItem>(Hash, Filename, OptionalT<uint16_t>{}, std::string{}, std::string{}, DefaultTitle, std::move(EngineMedia)));
+}
+
+void ClientCore::ReceivingInternal(HashT const &Hash, PathT const &Filename, uint64_t Size, std::string const &DefaultTitle)
+{
+	auto Found = MediaLookup.find(Hash);
+	if (Found != MediaLookup.end())
+	{
+		// Resumed after being preempted, from where it stopped
+		return;
+	}
+	auto File = std::make_shared<GrowingFile>(Filename, Size);
+	auto EngineMedia = Engine->OpenGrowing(File);
+	if (!EngineMedia)
+	{
+		if (LogCallback) LogCallback(Local("Failed to open arriving media, ^0: ^1", Filename, Engine->GetError()));
+		return;
+	}
+	auto Item = std::make_unique<MediaItem>(Hash, Filename, OptionalT<uint16_t>{}, std::string{}, std::string{}, DefaultTitle, std::move(EngineMedia));
+	Item->Receiving = File;
+	InsertInternal(std::move(Item));
+}
+
+void ClientCore::ProgressInternal(HashT const &Hash, uint64_t Available)
+{
+	auto Found = MediaLookup.find(Hash);
+	if ((Found == MediaLookup.end()) || !Found->second->Receiving) return;
+	Found->second->Receiving->SetAvailable(Available);
+}
+
+void ClientCore::InsertInternal(std::unique_ptr<MediaItem> &&NewItem)
+{
+	auto const Hash = NewItem->Hash;
+	auto &Item = *NewItem;
+	MediaLookup[Hash] = std::move(NewItem);
+	Item.Position = Parent.GetPosition(Hash);
+
+	auto Tags = RemoteTags.find(Hash);
+	if (Tags != RemoteTags.end())
+	{
+		// Already parsed by whoever sent it
+		ApplyTags(Item, Tags->second);
+		Item.Tagged = true;
+		RemoteTags.erase(Tags);
+	}
+
+	AddUpdateInternal(Item);
+
+	if (!Item.Tagged && !Item.Receiving) ParseTagsInternal(Hash, Item.Filename);
+
+	// Media that's still arriving can start playing right away, reads wait for the data
 	Core::PlayStatus LastPlayStatus = Parent.GetPlayStatus();
 	if (LastPlayStatus.Playing && (Hash == LastPlayStatus.MediaID))
 		PlayInternal(LastPlayStatus.MediaID, LastPlayStatus.MediaTime, LastPlayStatus.SystemTime, GetNow());
 }
 
+void ClientCore::ParseTagsInternal(HashT const &Hash, PathT const &Filename)
+{
+	// Tag parsing hits the disk, so it happens in the background and the item is updated when it's done
+	TagWorkers.Queue([this, Hash, Filename](void)
+	{
+		MediaTags Out;
+		TagLib::FileRef TagFile(Filename->Render().c_str());
+		auto Tags = TagFile.tag();
+		if (Tags)
+		{
+			auto const Track = Tags->track();
+			if ((Track > 0) && (Track <= 0xFFFF)) Out.Track = static_cast<uint16_t>(Track);
+			auto const Artist = Tags->artist();
+			if (!Artist.isEmpty()) Out.Artist = Artist.to8Bit(true);
+			auto const Album = Tags->album();
+			if (!Album.isEmpty()) Out.Album = Album.to8Bit(true);
+			auto const Title = Tags->title();
+			if (!Title.isEmpty()) Out.Title = Title.to8Bit(true);
+		}
+		auto Properties = TagFile.audioProperties();
+		if (Properties && (Properties->length() > 0)) Out.Duration = static_cast<uint64_t>(Properties->length()) * 1000;
+		CallTransfer([this, Hash, Out](void)
+		{
+			auto Found = MediaLookup.find(Hash);
+			if (Found == MediaLookup.end()) return;
+			auto &Item = *Found->second;
+			ApplyTags(Item, Out);
+			Item.Tagged = true;
+			AddUpdateInternal(Item);
+
+			// Share them, so peers don't have to parse again and can list it before it arrives
+			MediaTags Shared;
+			Shared.Track = Item.Track ? *Item.Track : 0;
+			Shared.Artist = Item.Artist;
+			Shared.Album = Item.Album;
+			Shared.Title = Item.Title;
+			Shared.Duration = Item.Duration;
+			Parent.SetTags(Hash, Shared);
+		});
+	});
+}
+
 void ClientCore::RemoveInternal(HashT const &Hash)
 {
+	FlushAddUpdatesInternal();
+	if (RemoteTags.erase(Hash) && RemoveCallback) RemoveCallback(Hash);
 	auto Found = MediaLookup.find(Hash);
 	if (Found == MediaLookup.end()) return;
 	if (RemoveCallback) RemoveCallback(Hash);
+	if (Found->second->Size != 0) SnapshotChangedInternal();
+	if (Found->second->Receiving) Found->second->Receiving->Cancel();
+	if (Preroll.Active && (Preroll.Media == Found->second.get()))
+	{
+		Parent.Cancel(SyncTimer);
+		Parent.Cancel(Preroll.Timer);
+		Preroll.Active = false;
+		Engine->Pause();
+	}
+	if (Playing == Found->second.get())
+	{
+		// Stops here only; peers play on
+		Parent.Cancel(SyncTimer);
+		Engine->Pause();
+		Playing = nullptr;
+		if (StopCallback) StopCallback();
+	}
 	MediaLookup.erase(Found);
 }
 
-void ClientCore::SetVolumeInternal(float Volume) { libvlc_audio_set_volume(Engine.VLCMediaPlayer, static_cast<int>(Volume * 100)); }
+void ClientCore::TagsInternal(HashT const &Hash, MediaTags const &Tags)
+{
+	auto Found = MediaLookup.find(Hash);
+	if (Found != MediaLookup.end())
+	{
+		ApplyTags(*Found->second, Tags);
+		Found->second->Tagged = true;
+		AddUpdateInternal(*Found->second);
+		return;
+	}
+
+	// List it now, it'll become playable when it arrives
+	RemoteTags[Hash] = Tags;
+	MediaInfo Item{Hash, {}, {}, {}, {}, {}};
+	ApplyTags(Item, Tags);
+	Item.Position = Parent.GetPosition(Hash);
+	AddUpdateInternal(Item);
+}
+
+void ClientCore::OrderInternal(HashT const &Hash, std::string const &Position)
+{
+	auto Found = MediaLookup.find(Hash);
+	if (Found != MediaLookup.end())
+	{
+		if (Found->second->Position == Position) return;
+		Found->second->Position = Position;
+		AddUpdateInternal(*Found->second);
+		return;
+	}
+
+	auto Tags = RemoteTags.find(Hash);
+	if (Tags == RemoteTags.end()) return; // Picked up when it's added
+	MediaInfo Item{Hash, {}, {}, {}, {}, {}};
+	ApplyTags(Item, Tags->second);
+	Item.Position = Position;
+	AddUpdateInternal(Item);
+}
+
+void ClientCore::AddUpdateInternal(MediaInfo const &Item)
+{
+	SnapshotChangedInternal();
+	auto Found = PendingAddUpdateLookup.find(Item.Hash);
+	if (Found != PendingAddUpdateLookup.end())
+	{
+		PendingAddUpdates[Found->second] = Item;
+		return;
+	}
+	if (PendingAddUpdates.empty()) Parent.Schedule(AddUpdateDelay, [this](void) { FlushAddUpdatesInternal(); });
+	PendingAddUpdateLookup[Item.Hash] = PendingAddUpdates.size();
+	PendingAddUpdates.push_back(Item);
+}
+
+void ClientCore::FlushAddUpdatesInternal(void)
+{
+	if (PendingAddUpdates.empty()) return;
+	std::vector<MediaInfo> Items;
+	Items.swap(PendingAddUpdates);
+	PendingAddUpdateLookup.clear();
+	if (AddUpdateCallback) AddUpdateCallback(std::move(Items));
+}
+
+MediaTimeT ClientCore::GetDurationInternal(MediaItem &Item)
+{
+	if (Item.EngineMedia)
+	{
+		auto const Duration = Engine->GetDuration(*Item.EngineMedia);
+		if (*Duration > 0) return Duration;
+	}
+	return MediaTimeT(Item.Duration);
+}
+
+bool ClientCore::OpenInternal(MediaItem &Item)
+{
+	if (Item.EngineMedia) return true;
+	Item.EngineMedia = Engine->Open(Item.Filename);
+	if (Item.EngineMedia) return true;
+	if (LogCallback) LogCallback(Local("Failed to open selected media, ^0: ^1", Item.Filename, Engine->GetError()));
+	return false;
+}
+
+void ClientCore::SetVolumeInternal(float Volume) { Engine->SetVolume(Volume); }
 
 float ClientCore::GetTimeInternal(void)
 {
-	auto const NewPosition = libvlc_media_player_get_position(Engine.VLCMediaPlayer);
-	if (NewPosition > 0) LastPosition = MediaTimePercentT{NewPosition};
+	if (Playing)
+	{
+		auto const Time = Engine->GetTime();
+		auto const Duration = GetDurationInternal(*Playing);
+		if (Time && (*Duration > 0) && (**Time > 0)) LastPosition = MediaTimePercentT{StrictCast(*Time, float) / StrictCast(Duration, float)};
+	}
 	return *LastPosition;
 }
 
@@ -198,25 +723,31 @@ void ClientCore::PlayInternal(HashT const &MediaID, MediaTimeT Position, uint64_
 {
 	auto Media = MediaLookup.find(MediaID);
 	if (Media == MediaLookup.end()) return;
-	libvlc_media_player_set_media(Engine.VLCMediaPlayer, Media->second->VLCMedia);
-	float StartTime = StrictCast(Position, float) / libvlc_media_player_get_length(Engine.VLCMediaPlayer);
-	if (SelectCallback) SelectCallback(MediaID);
+	if (!OpenInternal(*Media->second)) return;
+	Parent.Cancel(Preroll.Timer);
+	Preroll.Active = false;
+	EndingSent = false;
 	if (Now >= SystemTime)
 	{
-		libvlc_media_player_play(Engine.VLCMediaPlayer);
-		libvlc_media_player_set_time(Engine.VLCMediaPlayer, *Position + (Now - SystemTime));
+		Engine->Play(*Media->second->EngineMedia, MediaTimeT(*Position + (Now - SystemTime)));
+		Playing = Media->second.get();
+		FlushAddUpdatesInternal();
+		if (SelectCallback) SelectCallback(MediaID);
+		if (PlayCallback) PlayCallback();
 	}
 	else
 	{
-		libvlc_media_player_pause(Engine.VLCMediaPlayer);
-		Parent.Schedule((float)(SystemTime - Now /* - Epsilon */) / 1000.0f, [this, Position, StartTime](void)
-		{
-			libvlc_media_player_play(Engine.VLCMediaPlayer);
-			libvlc_media_player_set_time(Engine.VLCMediaPlayer, *Position);
-		});
+		// Opening and seeking take a while, so do them now and only start at the agreed time.  Anything already
+		// playing continues until then.
+		Preroll.Active = true;
+		Preroll.Media = Media->second.get();
+		Preroll.Position = Position;
+		Preroll.SystemTime = SystemTime;
+		Engine->Preroll(*Media->second->EngineMedia, Position);
 	}
-	Playing = Media->second.get();
-	if (PlayCallback) PlayCallback();
+	StartSync((Now >= SystemTime ? 0.0f : (float)(SystemTime - Now) / 1000.0f) + 1.0f); // Let the decoder settle first
+	if (Preroll.Active)
+		Preroll.Timer = Parent.Schedule((float)(SystemTime - Now) / 1000.0f, [this](void) { ReleasePrerollInternal(); });
 }
 
 void ClientCore::LocalStopInternal(void)
@@ -227,25 +758,411 @@ void ClientCore::LocalStopInternal(void)
 
 void ClientCore::StopInternal(void)
 {
-	libvlc_media_player_pause(Engine.VLCMediaPlayer);
+	Parent.Cancel(SyncTimer);
+	Parent.Cancel(Preroll.Timer);
+	Preroll.Active = false;
+	Engine->Pause();
 	if (StopCallback) StopCallback();
 }
 
-bool ClientCore::IsPlayingInternal(void) { return libvlc_media_player_is_playing(Engine.VLCMediaPlayer); }
+bool ClientCore::IsPlayingInternal(void) { return Engine->IsPlaying(); }
+
+void ClientCore::StartSync(float Delay)
+{
+	Parent.Cancel(SyncTimer);
+	Drift.Reset();
+	Engine->SetRate(1);
+	SyncTimer = Parent.Schedule(Delay, [this](void) { SyncInternal(); });
+}
+
+void ClientCore::SyncInternal(void)
+{
+	auto const &Status = Parent.GetPlayStatus();
+	if (!Status.Playing || !Playing || (Playing->Hash != Status.MediaID)) return;
+
+	auto const Now = GetNow();
+	auto const Actual = Engine->GetTime();
+	if ((Now >= Status.SystemTime) && Actual && IsPlayingInternal())
+	{
+		Parent.Position(Status.MediaID, *Actual, Now);
+
+		auto const Expected = *Status.MediaTime + (Now - Status.SystemTime);
+		auto const Error = static_cast<int64_t>(**Actual) - static_cast<int64_t>(Expected);
+		if (SyncCallback) SyncCallback(Error);
+		auto const Rate = Drift.Correct(Error);
+		if (!Rate)
+		{
+			Engine->SetRate(1);
+			Engine->Seek(MediaTimeT(Expected));
+		}
+		else Engine->SetRate(*Rate);
+
+		int64_t PeerError = 0;
+		for (auto Peer = PeerDrifts.begin(); Peer != PeerDrifts.end();)
+		{
+			if (Now - Peer->second.LastSeen > 10 * 1000) { Peer = PeerDrifts.erase(Peer); continue; }
+			if (std::abs(Peer->second.Error) > std::abs(PeerError)) PeerError = Peer->second.Error;
+			++Peer;
+		}
+		auto const Duration = GetDurationInternal(*Playing);
+		if (!EndingSent && (*Duration > 0) && (**Actual + HandoffLead >= *Duration))
+		{
+			EndingSent = true;
+			if (EndingCallback) EndingCallback();
+		}
+
+		if (Parent.LogCallback)
+		{
+			if (Rate) Parent.LogCallback(Core::Debug, Local("Playback is ^0ms off, rate ^1, furthest peer ^2ms off", Error, *Rate, PeerError));
+			else Parent.LogCallback(Core::Debug, Local("Playback is ^0ms off, seeking, furthest peer ^1ms off", Error, PeerError));
+		}
+	}
+
+	SyncTimer = Parent.Schedule(1.0f, [this](void) { SyncInternal(); });
+}
+
+void ClientCore::PositionInternal(uint64_t InstanceID, HashT const &MediaID, MediaTimeT MediaTime, uint64_t SystemTime)
+{
+	auto const &Status = Parent.GetPlayStatus();
+	if (!Status.Playing || (MediaID != Status.MediaID) || (SystemTime < Status.SystemTime)) return;
+	auto const Expected = *Status.MediaTime + (SystemTime - Status.SystemTime);
+	PeerDrifts[InstanceID] = PeerDrift{GetNow(), static_cast<int64_t>(*MediaTime) - static_cast<int64_t>(Expected)};
+}
+
+void ClientCore::ReleasePrerollInternal(void)
+{
+	if (!Preroll.Active) return;
+	auto const Now = GetNow();
+	if (Now < Preroll.SystemTime)
+	{
+		// Only if the delay lost precision on the way through the timer; start on time rather than early
+		Preroll.Timer = Parent.Schedule((float)(Preroll.SystemTime - Now) / 1000.0f, [this](void) { ReleasePrerollInternal(); });
+		return;
+	}
+	Preroll.Active = false;
+	auto const Error = static_cast<int64_t>(Now) - static_cast<int64_t>(Preroll.SystemTime);
+	Engine->Release(MediaTimeT(*Preroll.Position + (Error > 0 ? Error : 0)));
+	Playing = Preroll.Media;
+	FlushAddUpdatesInternal();
+	if (SelectCallback) SelectCallback(Playing->Hash);
+	if (PlayCallback) PlayCallback();
+	if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("Started ^0ms after the agreed time", Error));
+	if (StartCallback) StartCallback(Error);
+}
+
+std::string SearchIndex::Normalize(std::string const &Text)
+{
+	std::string Out;
+	Out.reserve(Text.size());
+	for (auto const Byte : Text) Out.push_back(((Byte >= 'A') && (Byte <= 'Z')) ? Byte - 'A' + 'a' : Byte);
+	return Out;
+}
+
+std::vector<std::string> SearchIndex::Terms(std::string const &Query)
+{
+	std::vector<std::string> Out;
+	auto const Normalized = Normalize(Query);
+	size_t Start = 0;
+	while (Start < Normalized.size())
+	{
+		auto End = Normalized.find(' ', Start);
+		if (End == std::string::npos) End = Normalized.size();
+		if (End > Start) Out.push_back(Normalized.substr(Start, End - Start));
+		Start = End + 1;
+	}
+	return Out;
+}
+
+std::vector<uint32_t> SearchIndex::Trigrams(std::string const &Text)
+{
+	std::vector<uint32_t> Out;
+	if (Text.size() < 3) return Out;
+	Out.reserve(Text.size() - 2);
+	for (size_t Position = 0; Position + 3 <= Text.size(); ++Position)
+		Out.push_back(
+			(static_cast<uint32_t>(static_cast<uint8_t>(Text[Position])) << 16) |
+			(static_cast<uint32_t>(static_cast<uint8_t>(Text[Position + 1])) << 8) |
+			static_cast<uint32_t>(static_cast<uint8_t>(Text[Position + 2])));
+	std::sort(Out.begin(), Out.end());
+	Out.erase(std::unique(Out.begin(), Out.end()), Out.end());
+	return Out;
+}
+
+bool SearchIndex::ContainsAll(std::string const &Text, std::vector<std::string> const &Terms)
+{
+	for (auto const &Term : Terms) if (Text.find(Term) == std::string::npos) return false;
+	return true;
+}
+
+void SearchIndex::Post(uint32_t Slot)
+{
+	auto const Grams = Trigrams(Entries[Slot].Text);
+	for (auto const Gram : Grams) Postings[Gram].push_back(Slot);
+	LivePostings += Grams.size();
+}
+
+void SearchIndex::Compact(void)
+{
+	Postings.clear();
+	LivePostings = 0;
+	StalePostings = 0;
+	for (uint32_t Slot = 0; Slot < Entries.size(); ++Slot) if (Entries[Slot].Live) Post(Slot);
+}
+
+void SearchIndex::Set(HashT const &Hash, std::string const &Text)
+{
+	auto Normalized = Normalize(Text);
+	auto Found = Slots.find(Hash);
+	uint32_t Slot;
+	if (Found != Slots.end())
+	{
+		Slot = Found->second;
+		if (Entries[Slot].Text == Normalized) return;
+		auto const Old = Trigrams(Entries[Slot].Text).size();
+		LivePostings -= Old;
+		StalePostings += Old;
+		Entries[Slot].Text = std::move(Normalized);
+	}
+	else
+	{
+		if (!FreeSlots.empty())
+		{
+			Slot = FreeSlots.back();
+			FreeSlots.pop_back();
+			Entries[Slot] = Entry{Hash, std::move(Normalized), true};
+		}
+		else
+		{
+			Slot = static_cast<uint32_t>(Entries.size());
+			Entries.push_back(Entry{Hash, std::move(Normalized), true});
+		}
+		Slots[Hash] = Slot;
+	}
+	Post(Slot);
+	if (StalePostings > LivePostings + 4096) Compact();
+}
+
+void SearchIndex::Remove(HashT const &Hash)
+{
+	auto Found = Slots.find(Hash);
+	if (Found == Slots.end()) return;
+	auto &Removed = Entries[Found->second];
+	auto const Old = Trigrams(Removed.Text).size();
+	LivePostings -= Old;
+	StalePostings += Old;
+	Removed.Live = false;
+	Removed.Text.clear();
+	FreeSlots.push_back(Found->second);
+	Slots.erase(Found);
+	if (StalePostings > LivePostings + 4096) Compact();
+}
+
+bool SearchIndex::Matches(HashT const &Hash, std::string const &Query) const
+{
+	auto Found = Slots.find(Hash);
+	if (Found == Slots.end()) return false;
+	return ContainsAll(Entries[Found->second].Text, Terms(Query));
+}
+
+std::vector<HashT> SearchIndex::Find(std::string const &Query) const
+{
+	std::vector<HashT> Out;
+	auto const QueryTerms = Terms(Query);
+
+	// Only check items with the rarest trigram in the query
+	std::vector<uint32_t> const *Candidates = nullptr;
+	bool Indexed = false;
+	for (auto const &Term : QueryTerms)
+		for (auto const Gram : Trigrams(Term))
+		{
+			Indexed = true;
+			auto Posting = Postings.find(Gram);
+			if (Posting == Postings.end()) return Out;
+			if (!Candidates || (Posting->second.size() < Candidates->size())) Candidates = &Posting->second;
+		}
+
+	if (!Indexed)
+	{
+		// Too short to narrow down
+		for (auto const &Item : Entries)
+			if (Item.Live && ContainsAll(Item.Text, QueryTerms)) Out.push_back(Item.Hash);
+		return Out;
+	}
+
+	std::vector<bool> Seen(Entries.size(), false); // Postings can repeat slots that changed
+	for (auto const Slot : *Candidates)
+	{
+		if (Seen[Slot]) continue;
+		Seen[Slot] = true;
+		auto const &Item = Entries[Slot];
+		if (Item.Live && ContainsAll(Item.Text, QueryTerms)) Out.push_back(Item.Hash);
+	}
+	return Out;
+}
+
+static void AppendLower(std::string const &Text, size_t &Position, std::ctype<wchar_t> const &Case, std::string &Out)
+{
+	// Decodes the UTF-8 character at Position and appends it lower cased, so accented and other non-ASCII letters
+	// fold like ASCII ones.  Bytes that aren't valid UTF-8 are copied as they are.
+	auto const Lead = static_cast<uint8_t>(Text[Position]);
+	size_t const Length =
+		(Lead < 0x80) ? 1 :
+		((Lead & 0xE0) == 0xC0) ? 2 :
+		((Lead & 0xF0) == 0xE0) ? 3 :
+		((Lead & 0xF8) == 0xF0) ? 4 : 0;
+	uint32_t Code = Lead & (0x7Fu >> (Length > 1 ? Length : 0));
+	bool Valid = (Length > 0) && (Position + Length <= Text.size());
+	for (size_t Index = 1; Valid && (Index < Length); ++Index)
+	{
+		auto const Continuation = static_cast<uint8_t>(Text[Position + Index]);
+		Valid = (Continuation & 0xC0) == 0x80;
+		Code = (Code << 6) | (Continuation & 0x3Fu);
+	}
+	if (!Valid || (Code > static_cast<uint32_t>(std::numeric_limits<wchar_t>::max())))
+	{
+		Out.push_back(Text[Position++]);
+		return;
+	}
+	Position += Length;
+
+	Code = static_cast<uint32_t>(Case.tolower(static_cast<wchar_t>(Code)));
+	if (Code < 0x80)
+	{
+		Out.push_back(static_cast<char>(Code));
+		return;
+	}
+	static uint8_t const Leads[] = {0x00, 0xC0, 0xE0, 0xF0};
+	size_t const Continuations = (Code < 0x800) ? 1 : (Code < 0x10000) ? 2 : 3;
+	Out.push_back(static_cast<char>(Leads[Continuations] | (Code >> (6 * Continuations))));
+	for (size_t Index = Continuations; Index-- > 0;) Out.push_back(static_cast<char>(0x80u | ((Code >> (6 * Index)) & 0x3Fu)));
+}
+
+static std::string CollationKey(std::string const &Text)
+{
+	// Case folded by the user's locale and with digit runs zero padded so "2" sorts before "10", then transformed so
+	// plain byte comparison follows the locale's collation
+	static std::locale const Locale = [](void)
+	{
+		try { return std::locale(""); }
+		catch (...) { return std::locale::classic(); }
+	}();
+	static auto const &Case = std::use_facet<std::ctype<wchar_t>>(Locale);
+	static auto const &Collate = std::use_facet<std::collate<char>>(Locale);
+
+	std::string Folded;
+	Folded.reserve(Text.size());
+	for (size_t Position = 0; Position < Text.size();)
+	{
+		if ((Text[Position] >= '0') && (Text[Position] <= '9'))
+		{
+			auto End = Position;
+			while ((End < Text.size()) && (Text[End] >= '0') && (Text[End] <= '9')) ++End;
+			while ((Position + 1 < End) && (Text[Position] == '0')) ++Position;
+			if (End - Position < 10) Folded.append(10 - (End - Position), '0');
+			Folded.append(Text, Position, End - Position);
+			Position = End;
+			continue;
+		}
+		AppendLower(Text, Position, Case, Folded);
+	}
+	return Collate.transform(Folded.data(), Folded.data() + Folded.size());
+}
+
+PlaylistType::PlaylistInfo::PlaylistInfo(HashT const &Hash, decltype(State) const &State, OptionalT<uint16_t> const &Track, std::string const &Title, std::string const &Album, std::string const &Artist) : Hash(Hash), State{State}, Track{Track}, Title{Title}, Album{Album}, Artist{Artist}
+	{ UpdateKeys(); }
+PlaylistType::PlaylistInfo::PlaylistInfo(void) : Keys{0} {}
+
+void PlaylistType::PlaylistInfo::UpdateKeys(void)
+{
+	Keys.Track = Track ? *Track + 1u : 0u;
+	Keys.Title = CollationKey(Title);
+	Keys.Album = CollationKey(Album);
+	Keys.Artist = CollationKey(Artist);
+}
+
+bool PlaylistType::PositionLess(PlaylistInfo const &First, PlaylistInfo const &Second)
+{
+	if (Second.Position.empty()) return !First.Position.empty();
+	if (First.Position.empty()) return false;
+	if (First.Position != Second.Position) return First.Position < Second.Position;
+	return First.Hash < Second.Hash;
+}
+
+bool PlaylistType::IsPositionSorted(void) const
+{
+	for (size_t Row = 1; Row < Playlist.size(); ++Row)
+		if (PositionLess(Playlist[Row], Playlist[Row - 1])) return false;
+	return true;
+}
+
+void PlaylistType::SortByPosition(void)
+{
+	auto const CurrentID = GetCurrentID();
+	std::stable_sort(Playlist.begin(), Playlist.end(), PositionLess);
+	Reindex(CurrentID);
+}
+
+void PlaylistType::Renumber(void)
+{
+	// Keep the positions of the longest run of rows (not necessarily adjacent) that are already in increasing
+	// position order and place everything else between them
+	std::vector<size_t> Tails; // Last row of the best run of each length
+	std::vector<size_t> Previous(Playlist.size(), Playlist.size());
+	for (size_t Row = 0; Row < Playlist.size(); ++Row)
+	{
+		if (Playlist[Row].Position.empty()) continue;
+		auto Slot = std::lower_bound(Tails.begin(), Tails.end(), Row, [this](size_t const Tail, size_t const Row)
+			{ return Playlist[Tail].Position < Playlist[Row].Position; });
+		if (Slot != Tails.begin()) Previous[Row] = *(Slot - 1);
+		if (Slot == Tails.end()) Tails.push_back(Row);
+		else *Slot = Row;
+	}
+	std::vector<bool> Keep(Playlist.size(), false);
+	for (size_t Row = Tails.empty() ? Playlist.size() : Tails.back(); Row < Playlist.size(); Row = Previous[Row])
+		Keep[Row] = true;
+
+	std::vector<OrderPosition> Changes;
+	size_t Start = 0;
+	while (Start < Playlist.size())
+	{
+		if (Keep[Start]) { ++Start; continue; }
+		auto End = Start;
+		while ((End < Playlist.size()) && !Keep[End]) ++End;
+		auto const Positions = OrderSpread(
+			Start > 0 ? Playlist[Start - 1].Position : std::string{},
+			End < Playlist.size() ? Playlist[End].Position : std::string{},
+			End - Start);
+		for (size_t Row = Start; Row < End; ++Row)
+		{
+			Playlist[Row].Position = Positions[Row - Start];
+			Changes.push_back({Playlist[Row].Hash, Playlist[Row].Position});
+		}
+		Start = End;
+	}
+	if (!Changes.empty() && ReorderCallback) ReorderCallback(Changes);
+}
 
-void ClientCore::VLCMediaEndCallback(libvlc_event_t const *Event, void *UserData)
+void PlaylistType::ReportPositions(size_t First, size_t Count)
 {
-	auto This = static_cast<ClientCore *>(UserData);
-	if (This->EndCallback) This->EndCallback();
+	if (!ReorderCallback || (Count == 0)) return;
+	std::vector<OrderPosition> Changes;
+	Changes.reserve(Count);
+	for (size_t Row = First; Row < First + Count; ++Row) Changes.push_back({Playlist[Row].Hash, Playlist[Row].Position});
+	ReorderCallback(Changes);
 }
 
-PlaylistType::PlaylistInfo::PlaylistInfo(HashT const &Hash, decltype(State) const &State, OptionalT<uint16_t> const &Track, std::string const &Title, std::string const &Album, std::string const &Artist) : Hash(Hash), State{State}, Track{Track}, Title{Title}, Album{Album}, Artist{Artist} {}
-PlaylistType::PlaylistInfo::PlaylistInfo(void) {}
+void PlaylistType::Reindex(OptionalT<HashT> const &CurrentID, size_t From)
+{
+	if (From == 0) Lookup.clear();
+	for (size_t Row = From; Row < Playlist.size(); ++Row) Lookup[Playlist[Row].Hash] = Row;
+	if (CurrentID) Index = Find(*CurrentID);
+}
 
-OptionalT<size_t> PlaylistType::Find(HashT const &Hash)
+OptionalT<size_t> PlaylistType::Find(HashT const &Hash) const
 {
-	for (size_t Index = 0; Index < Playlist.size(); ++Index) if (Playlist[Index].Hash == Hash) return Index;
-	return {};
+	auto Found = Lookup.find(Hash);
+	if (Found == Lookup.end()) return {};
+	return Found->second;
 }
 
 void PlaylistType::AddUpdate(MediaInfo const &Item)
@@ -253,7 +1170,9 @@ void PlaylistType::AddUpdate(MediaInfo const &Item)
 	auto Found = Find(Item.Hash);
 	if (!Found)
 	{
+		Lookup[Item.Hash] = Playlist.size();
 		Playlist.emplace_back(Item.Hash, PlayState::Deselected, Item.Track, Item.Title, Item.Album, Item.Artist);
+		Playlist.back().Position = Item.Position;
 	}
 	else
 	{
@@ -261,7 +1180,17 @@ void PlaylistType::AddUpdate(MediaInfo const &Item)
 		Playlist[*Found].Title = Item.Title;
 		Playlist[*Found].Album = Item.Album;
 		Playlist[*Found].Artist = Item.Artist;
+		if (!Item.Position.empty()) Playlist[*Found].Position = Item.Position;
+		Playlist[*Found].UpdateKeys();
 	}
+	Searchable.Set(Item.Hash, Item.Artist + "\n" + Item.Album + "\n" + Item.Title);
+}
+
+void PlaylistType::AddUpdate(std::vector<MediaInfo> const &Items)
+{
+	Playlist.reserve(Playlist.size() + Items.size());
+	for (auto const &Item : Items) AddUpdate(Item);
+	if (!LocalOrder && !IsPositionSorted()) SortByPosition();
 }
 
 void PlaylistType::Remove(HashT const &Hash)
@@ -269,7 +1198,11 @@ void PlaylistType::Remove(HashT const &Hash)
 	auto Found = Find(Hash);
 	if (!Found) return;
 	if (Index && (*Found == *Index)) Index = {};
+	auto const CurrentID = GetCurrentID();
+	Lookup.erase(Hash);
+	Searchable.Remove(Hash);
 	Playlist.erase(Playlist.begin() + *Found);
+	Reindex(CurrentID, *Found);
 }
 
 bool PlaylistType::Select(HashT const &Hash)
@@ -342,6 +1275,26 @@ OptionalT<HashT> PlaylistType::GetPreviousID(void) const
 	}
 }
 
+std::vector<HashT> PlaylistType::GetUpcomingIDs(size_t Count) const
+{
+	std::vector<HashT> Out;
+	size_t Next = Index ? *Index + 1 : 0;
+	for (; (Next < Playlist.size()) && (Out.size() < Count); ++Next) Out.push_back(Playlist[Next].Hash);
+	return Out;
+}
+
+std::vector<size_t> PlaylistType::Search(std::string const &Query) const
+{
+	std::vector<size_t> Out;
+	for (auto const &Hash : Searchable.Find(Query))
+	{
+		auto Found = Find(Hash);
+		if (Found) Out.push_back(*Found);
+	}
+	std::sort(Out.begin(), Out.end());
+	return Out;
+}
+
 void PlaylistType::Play(void)
 {
 	if (!Index) return;
@@ -356,29 +1309,67 @@ void PlaylistType::Stop(void)
 
 void PlaylistType::Shuffle(void)
 {
-	HashT CurrentID;
-	if (Index)
+	auto const CurrentID = GetCurrentID();
+	std::random_shuffle(Playlist.begin(), Playlist.end());
+	Reindex(CurrentID);
+	LocalOrder = true;
+}
+
+void PlaylistType::Move(size_t First, size_t Count, size_t To)
+{
+	assert(First + Count <= Playlist.size());
+	assert(To <= Playlist.size());
+	if ((To >= First) && (To <= First + Count)) return;
+	size_t Start, End, Destination;
+	if (To < First)
 	{
-		assert(*Index < Playlist.size());
-		CurrentID = Playlist[*Index].Hash;
+		std::rotate(Playlist.begin() + To, Playlist.begin() + First, Playlist.begin() + First + Count);
+		Start = To;
+		End = First + Count;
+		Destination = To;
 	}
-	std::random_shuffle(Playlist.begin(), Playlist.end());
-	auto Found = Find(CurrentID);
-	if (Found) Index = *Found;
+	else
+	{
+		std::rotate(Playlist.begin() + First, Playlist.begin() + First + Count, Playlist.begin() + To);
+		Start = First;
+		End = To;
+		Destination = To - Count;
+	}
+	for (size_t Row = Start; Row < End; ++Row) Lookup[Playlist[Row].Hash] = Row;
+	if (Index && (*Index >= Start) && (*Index < End))
+	{
+		if ((*Index >= First) && (*Index < First + Count)) Index = *Index - First + Destination;
+		else if (To < First) Index = *Index + Count;
+		else Index = *Index - Count;
+	}
+
+	if (LocalOrder) return;
+
+	// Place the moved rows between their new neighbours, unless that would leave a placed row after unplaced ones
+	auto const &Low = Destination > 0 ? Playlist[Destination - 1].Position : std::string{};
+	auto const &High = Destination + Count < Playlist.size() ? Playlist[Destination + Count].Position : std::string{};
+	if (((Destination > 0) && Low.empty()) || (!High.empty() && (Low >= High)))
+	{
+		Renumber();
+		return;
+	}
+	auto const Positions = OrderSpread(Low, High, Count);
+	for (size_t Row = 0; Row < Count; ++Row) Playlist[Destination + Row].Position = Positions[Row];
+	ReportPositions(Destination, Count);
 }
 
 PlaylistType::SortFactor::SortFactor(PlaylistColumns const Column, bool const Reverse) : Column{Column}, Reverse{Reverse} {}
 
 void PlaylistType::Sort(std::list<SortFactor> const &Factors)
 {
-	HashT CurrentID;
-	if (Index)
-	{
-		assert(*Index < Playlist.size());
-		CurrentID = Playlist[*Index].Hash;
-	}
-	std::stable_sort(Playlist.begin(), Playlist.end(), [&Factors](PlaylistType::PlaylistInfo const &First, PlaylistType::PlaylistInfo const &Second)
+	// Sorts row numbers rather than moving whole rows around during the sort
+	auto const CurrentID = GetCurrentID();
+	std::vector<size_t> Order(Playlist.size());
+	std::iota(Order.begin(), Order.end(), 0);
+	std::stable_sort(Order.begin(), Order.end(), [this, &Factors](size_t const FirstRow, size_t const SecondRow)
 	{
+		auto const &First = Playlist[FirstRow].Keys;
+		auto const &Second = Playlist[SecondRow].Keys;
 		for (auto &Factor : Factors)
 		{
 			auto const Fix = [&Factor](bool const Verdict) { if (Factor.Reverse) return !Verdict; return Verdict; };
@@ -386,23 +1377,50 @@ void PlaylistType::Sort(std::list<SortFactor> const &Factors)
 			{
 				case PlaylistColumns::Track:
 					if (First.Track == Second.Track) continue;
-					if (!First.Track) return Fix(true);
-					if (!Second.Track) return Fix(false);
-					return Fix(*First.Track < *Second.Track);
+					return Fix(First.Track < Second.Track);
 				case PlaylistColumns::Title:
-					if (First.Title == Second.Title) continue;
-					return Fix(First.Title < Second.Title);
+				{
+					auto const Compared = First.Title.compare(Second.Title);
+					if (Compared == 0) continue;
+					return Fix(Compared < 0);
+				}
 				case PlaylistColumns::Album:
-					if (First.Album == Second.Album) continue;
-					return Fix(First.Album < Second.Album);
+				{
+					auto const Compared = First.Album.compare(Second.Album);
+					if (Compared == 0) continue;
+					return Fix(Compared < 0);
+				}
 				case PlaylistColumns::Artist:
-					if (First.Artist == Second.Artist) continue;
-					return Fix(First.Artist < Second.Artist);
+				{
+					auto const Compared = First.Artist.compare(Second.Artist);
+					if (Compared == 0) continue;
+					return Fix(Compared < 0);
+				}
 				default: assert(false); continue;
 			}
 		}
 		return false;
 	});
-	auto Found = Find(CurrentID);
-	if (Found) Index = *Found;
+	std::vector<PlaylistInfo> Sorted;
+	Sorted.reserve(Playlist.size());
+	for (auto const Row : Order) Sorted.push_back(std::move(Playlist[Row]));
+	Playlist.swap(Sorted);
+	Reindex(CurrentID);
+	LocalOrder = true;
+}
+
+bool PlaylistType::HasLocalOrder(void) const { return LocalOrder; }
+
+void PlaylistType::ShareOrder(void)
+{
+	if (!LocalOrder) return;
+	LocalOrder = false;
+	Renumber();
+}
+
+void PlaylistType::UnshareOrder(void)
+{
+	if (!LocalOrder) return;
+	LocalOrder = false;
+	SortByPosition();
 }
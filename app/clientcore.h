@@ -3,40 +3,52 @@
 
 #include "shared.h"
 #include "core.h"
+#include "engine.h"
 
-#include <vlc/vlc.h>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
 #include <vector>
 
 typedef StrictType(float) MediaTimePercentT;
 
+// Tracks how long messages take to reach this instance from each other instance.  Clock messages arrive already
+// translated into the local clock so the samples don't depend on wall clocks agreeing.
 struct LatencyTracker
 {
-	// Cheap implementation
-	void Add(uint64_t Instance, uint64_t Sent)
-	{
-		auto Now = GetNow();
-		if (Sent > Now) return; // Clocks out of synch probably
-		auto Milliseconds = Now - Sent;
-		if (Milliseconds > Max) Max = Milliseconds;
-	}
+	void Add(uint64_t Instance, uint64_t Sent);
 
-	uint64_t Expected(void) const
-	{
-		return Max * 2;
-	}
+	// Time to allow for a message to reach every instance
+	uint64_t Expected(void) const;
 
 	private:
-		uint64_t Max = 0;
+		struct InstanceSamples
+		{
+			uint64_t LastSeen;
+			std::deque<uint64_t> Transit;
+		};
+		std::map<uint64_t, InstanceSamples> Instances;
 };
 
-struct EngineWrapper
+// Keeps local playback on the agreed timeline.  Small errors are trimmed by nudging the playback rate so there are no
+// audible jumps, large ones (startup, stalls) by seeking.
+struct DriftCorrector
 {
-	EngineWrapper(void);
-	~EngineWrapper(void);
+	static constexpr int64_t Target = 10; // ms
+	static constexpr int64_t SeekThreshold = 250; // ms
+	static constexpr float Window = 2000; // ms, time to trim an error away over
+	static constexpr float MaxAdjustment = 0.02f;
+
+	void Reset(void);
 
-	libvlc_instance_t *VLC;
-	libvlc_media_player_t *VLCMediaPlayer;
+	// Error is the actual minus the expected media position in ms.  Returns the rate to play at, or nothing if playback
+	// should seek to the expected position.
+	OptionalT<float> Correct(int64_t Error);
+
+	private:
+		std::deque<int64_t> Errors;
+		float Rate = 1;
 };
 
 struct MediaInfo
@@ -47,35 +59,48 @@ struct MediaInfo
 	std::string Artist;
 	std::string Album;
 	std::string Title;
+	uint64_t Duration = 0; // ms, 0 if unknown
+	std::string Position; // In the shared playlist, see OrderPosition
 };
 
 struct MediaItem : MediaInfo
 {
-	libvlc_media_t *VLCMedia;
+	std::unique_ptr<AudioEngine::Media> EngineMedia; // Null until first played, for restored media
+	std::shared_ptr<GrowingFile> Receiving; // While it's still arriving
+	bool Tagged = false;
+	// Set for media added locally, which is what's saved in snapshots
+	uint64_t Size = 0;
+	int64_t ModifiedTime = 0;
 
-	MediaItem(HashT const &Hash, PathT const &Filename, OptionalT<uint16_t> const &Track, std::string const &Artist, std::string const &Album, std::string const &Title, libvlc_media_t *VLCMedia);
-	~MediaItem(void);
+	MediaItem(HashT const &Hash, PathT const &Filename, OptionalT<uint16_t> const &Track, std::string const &Artist, std::string const &Album, std::string const &Title, std::unique_ptr<AudioEngine::Media> &&EngineMedia);
 };
 
 struct ClientCore
 {
 	ClientCore(ClientCore const &Other) = delete;
 	ClientCore(ClientCore &&Other) = delete;
-	ClientCore(float Volume);
+	ClientCore(float Volume, EngineType Type = EngineType::VLC);
+	// With an engine from MakeEngine, such as a configured NullEngine in tests
+	ClientCore(float Volume, std::function<std::unique_ptr<AudioEngine>(CallTransferType &CallTransfer)> const &MakeEngine);
 
 	std::function<void(std::string const &Message)> LogCallback;
 	std::function<void(float Percent, float Duration)> SeekCallback;
-	std::function<void(MediaInfo Item)> AddCallback;
+	std::function<void(std::vector<MediaInfo> Items)> AddUpdateCallback; // New or changed items, batched; one entry per item
 	std::function<void(HashT const &MediaID)> RemoveCallback;
-	std::function<void(MediaInfo Item)> UpdateCallback;
 	std::function<void(HashT const &MediaID)> SelectCallback;
 	std::function<void(void)> PlayCallback;
 	std::function<void(void)> StopCallback;
 	std::function<void(void)> EndCallback;
+	std::function<void(void)> EndingCallback; // Shortly before the end, to queue the next item with PlayNext
+	std::function<void(int64_t Error)> StartCallback; // ms a scheduled play started after the agreed time, negative if early
+	std::function<void(int64_t Error)> SyncCallback; // ms playback was ahead of the agreed timeline at a sync check, before correcting
 
 	void Open(bool Listen, std::string const &Host, uint16_t Port);
 
 	void Add(HashT const &Hash, size_t Size, PathT const &Filename);
+	// Adds the local media saved at Path by an earlier session without rehashing or reparsing it, then keeps Path up
+	// to date.  Files that changed since are checked in the background and rehashed or removed.
+	void Restore(PathT const &Path);
 	void Remove(HashT const &Hash);
 	void RemoveAll(void);
 
@@ -85,12 +110,29 @@ struct ClientCore
 	void Play(HashT const &MediaID, MediaTimeT Position);
 	void Play(HashT const &MediaID, float Position);
 	void Play(void);
+	void PlayNext(HashT const &MediaID); // Starts when the current item ends, gaplessly
+	void Prioritize(std::vector<HashT> const &MediaIDs); // Media to fetch first, such as the next few in the playlist
+	void Reorder(std::vector<OrderPosition> const &Positions); // Changes to the shared playlist order
 	void Stop(void);
 	void Chat(std::string const &Message);
 
 	private:
 		void AddInternal(HashT const &Hash, PathT const &Filename, std::string const &DefaultTitle);
+		void AddLocalInternal(HashT const &Hash, uint64_t Size, int64_t ModifiedTime, PathT const &Filename);
+		void RestoreInternal(PathT const &Path);
+		void SnapshotChangedInternal(void);
+		void SaveInternal(void);
+		void ReceivingInternal(HashT const &Hash, PathT const &Filename, uint64_t Size, std::string const &DefaultTitle);
+		void ProgressInternal(HashT const &Hash, uint64_t Available);
+		void InsertInternal(std::unique_ptr<MediaItem> &&NewItem);
+		void ParseTagsInternal(HashT const &Hash, PathT const &Filename);
 		void RemoveInternal(HashT const &Hash);
+		void TagsInternal(HashT const &Hash, MediaTags const &Tags);
+		void OrderInternal(HashT const &Hash, std::string const &Position);
+		void AddUpdateInternal(MediaInfo const &Item);
+		void FlushAddUpdatesInternal(void);
+		MediaTimeT GetDurationInternal(MediaItem &Item);
+		bool OpenInternal(MediaItem &Item); // Opens EngineMedia if it isn't yet, false if that failed
 
 		void SetVolumeInternal(float Volume);
 		float GetTimeInternal(void);
@@ -101,18 +143,56 @@ struct ClientCore
 		void StopInternal(void);
 		bool IsPlayingInternal(void);
 
-		static void VLCMediaEndCallback(libvlc_event_t const *Event, void *UserData);
+		void StartSync(float Delay);
+		void SyncInternal(void);
+		void PositionInternal(uint64_t InstanceID, HashT const &MediaID, MediaTimeT MediaTime, uint64_t SystemTime);
+
+		void ReleasePrerollInternal(void);
 
 		CallTransferType &CallTransfer; // Makes a call in the core's main thread
 
 		Core Parent;
 
-		EngineWrapper Engine;
+		std::unique_ptr<AudioEngine> Engine;
 		std::map<HashT, std::unique_ptr<MediaItem>> MediaLookup;
+		std::map<HashT, MediaTags> RemoteTags; // From peers, for media that hasn't arrived yet
+
+		// Adds and updates are collected for a moment and sent together, so front ends don't redraw per item while
+		// a library arrives.  Sent early before anything that refers to an item, like a select or remove.
+		std::vector<MediaInfo> PendingAddUpdates;
+		std::map<HashT, size_t> PendingAddUpdateLookup;
+		static constexpr float AddUpdateDelay = 0.05f; // s
+
+		OptionalT<PathT> SnapshotPath;
+		TimerWheel::HandleT SaveTimer; // Changes until it fires are saved together
+		static constexpr float SaveDelay = 5.0f; // s
 		MediaItem *Playing;
 		MediaTimePercentT LastPosition;
 
+		// Media for a play scheduled in the future is prerolled and released at the agreed time
+		struct
+		{
+			bool Active;
+			MediaItem *Media;
+			MediaTimeT Position;
+			uint64_t SystemTime;
+			TimerWheel::HandleT Timer;
+		} Preroll;
+		static constexpr uint64_t HandoffLead = 5000; // ms before the end to ask for the next item
+		bool EndingSent;
+
 		LatencyTracker Latencies;
+
+		DriftCorrector Drift;
+		TimerWheel::HandleT SyncTimer;
+		struct PeerDrift
+		{
+			uint64_t LastSeen;
+			int64_t Error;
+		};
+		std::map<uint64_t, PeerDrift> PeerDrifts;
+
+		WorkerPool TagWorkers; // Last, so it stops before anything it calls back into
 };
 
 enum class PlaylistColumns
@@ -125,6 +205,40 @@ enum class PlaylistColumns
 
 enum struct PlayState { Deselected, Pause, Play };
 
+// Substring search over item text, by trigram.  Queries are split into words and an item matches if it contains
+// all of them, ignoring ASCII case.
+struct SearchIndex
+{
+	void Set(HashT const &Hash, std::string const &Text);
+	void Remove(HashT const &Hash);
+	bool Matches(HashT const &Hash, std::string const &Query) const;
+	std::vector<HashT> Find(std::string const &Query) const; // Unordered
+
+	private:
+		static std::string Normalize(std::string const &Text);
+		static std::vector<std::string> Terms(std::string const &Query);
+		static std::vector<uint32_t> Trigrams(std::string const &Text);
+		static bool ContainsAll(std::string const &Text, std::vector<std::string> const &Terms);
+		void Post(uint32_t Slot);
+		void Compact(void);
+
+		struct Entry
+		{
+			HashT Hash;
+			std::string Text; // Normalized
+			bool Live;
+		};
+		std::vector<Entry> Entries;
+		std::vector<uint32_t> FreeSlots;
+		std::unordered_map<HashT, uint32_t, HashHashT> Slots;
+
+		// Postings aren't removed when an entry changes, candidates are checked against the current text instead.
+		// They're rebuilt once stale ones outnumber live ones.
+		std::unordered_map<uint32_t, std::vector<uint32_t>> Postings;
+		size_t LivePostings = 0;
+		size_t StalePostings = 0;
+};
+
 struct PlaylistType
 {
 	struct PlaylistInfo
@@ -135,16 +249,48 @@ struct PlaylistType
 		std::string Title;
 		std::string Album;
 		std::string Artist;
+		std::string Position; // Empty if not placed in the shared order yet
+
+		// Precomputed so sorting doesn't redo case folding and collation per comparison; see UpdateKeys
+		struct
+		{
+			uint32_t Track; // 0 if none
+			std::string Title;
+			std::string Album;
+			std::string Artist;
+		} Keys;
+
 		PlaylistInfo(HashT const &Hash, decltype(State) const &State, OptionalT<uint16_t> const &Track, std::string const &Title, std::string const &Album, std::string const &Artist);
 		PlaylistInfo(void);
+		void UpdateKeys(void); // After changing tags
 	};
 	protected:
 		std::vector<PlaylistInfo> Playlist;
+		std::unordered_map<HashT, size_t, HashHashT> Lookup; // Hash to row in Playlist
+		SearchIndex Searchable;
 		OptionalT<size_t> Index;
+
+		// Call after reordering Playlist directly.  Rows before From must be unchanged.  Index is moved to
+		// CurrentID's new row.
+		void Reindex(OptionalT<HashT> const &CurrentID, size_t From = 0);
+
+		// Rows are kept in shared order: placed rows by (Position, Hash), then unplaced rows.  After a move
+		// Renumber gives new positions to the fewest rows that put the shared order in the current row order, and
+		// reports them through ReorderCallback.  Sorts and shuffles only reorder the rows here (LocalOrder) until
+		// ShareOrder; meanwhile new items are appended and remote moves only change positions.
+		bool LocalOrder = false;
+		static bool PositionLess(PlaylistInfo const &First, PlaylistInfo const &Second);
+		bool IsPositionSorted(void) const;
+		void SortByPosition(void);
+		void Renumber(void);
+		void ReportPositions(size_t First, size_t Count);
 	public:
 
-	OptionalT<size_t> Find(HashT const &Hash);
+	std::function<void(std::vector<OrderPosition> const &Positions)> ReorderCallback; // After local reorders
+
+	OptionalT<size_t> Find(HashT const &Hash) const;
 	void AddUpdate(MediaInfo const &Item);
+	void AddUpdate(std::vector<MediaInfo> const &Items);
 	void Remove(HashT const &Hash);
 	bool Select(HashT const &Hash);
 	OptionalT<bool> IsPlaying(void);
@@ -154,9 +300,14 @@ struct PlaylistType
 	std::vector<PlaylistInfo> const &GetItems(void) const;
 	OptionalT<HashT> GetNextID(void) const;
 	OptionalT<HashT> GetPreviousID(void) const;
+	std::vector<HashT> GetUpcomingIDs(size_t Count) const;
+	std::vector<size_t> Search(std::string const &Query) const; // Rows, in order
 	void Play(void);
 	void Stop(void);
 	void Shuffle(void);
+	// Moves Count rows starting at First to before row To, numbered as before the move.  Only rows between the
+	// two positions are touched.
+	void Move(size_t First, size_t Count, size_t To);
 	struct SortFactor
 	{
 		PlaylistColumns Column;
@@ -164,6 +315,9 @@ struct PlaylistType
 		SortFactor(PlaylistColumns const Column, bool const Reverse);
 	};
 	void Sort(std::list<SortFactor> const &Factors);
+	bool HasLocalOrder(void) const;
+	void ShareOrder(void); // Makes the current row order everyone's
+	void UnshareOrder(void); // Goes back to the shared order
 };
 
 #endif
@@ -4,13 +4,56 @@
 #include "../ren-cxx-filesystem/filesystem_string.h"
 
 #include <random>
+#include <limits>
+
+HashT const VersionProbe = {{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}};
 
 uint64_t GeneratePUID(void) // Probably Unique ID
 {
-	std::mt19937 Random;
+	std::mt19937_64 Random{std::random_device{}()};
 	return std::uniform_int_distribution<uint64_t>{}(Random);
 }
 
+bool MediaTags::operator ==(MediaTags const &Other) const
+	{ return (Track == Other.Track) && (Artist == Other.Artist) && (Album == Other.Album) && (Title == Other.Title) && (Duration == Other.Duration); }
+
+bool MediaTags::operator !=(MediaTags const &Other) const { return !(*this == Other); }
+
+void ClockEstimator::Add(uint64_t RequestSent, uint64_t RequestReceived, uint64_t ResponseSent, uint64_t ResponseReceived)
+{
+	if (ResponseReceived < RequestSent) return;
+	if (ResponseSent < RequestReceived) return;
+	Sample NewSample;
+	NewSample.Delay = (ResponseReceived - RequestSent) - std::min(ResponseSent - RequestReceived, ResponseReceived - RequestSent);
+	NewSample.Offset = (
+		(static_cast<int64_t>(RequestReceived) - static_cast<int64_t>(RequestSent)) +
+		(static_cast<int64_t>(ResponseSent) - static_cast<int64_t>(ResponseReceived))) / 2;
+	Samples.push_back(NewSample);
+	if (Samples.size() > 8) Samples.pop_front();
+
+	// Delay inflates the error of the offset, so the least delayed recent sample is the most trustworthy.  This also
+	// throws out samples that hit a spike.
+	BestIndex = 0;
+	for (size_t Index = 1; Index < Samples.size(); ++Index)
+		if (Samples[Index].Delay <= Samples[BestIndex].Delay) BestIndex = Index;
+}
+
+size_t ClockEstimator::Count(void) const { return Samples.size(); }
+
+int64_t ClockEstimator::Offset(void) const
+{
+	if (Samples.empty()) return 0; // Peers that don't support clock requests are assumed to be synchronized
+	return Samples[BestIndex].Offset;
+}
+
+uint64_t ClockEstimator::Delay(void) const
+{
+	if (Samples.empty()) return 0;
+	return Samples[BestIndex].Delay;
+}
+
+uint64_t ClockEstimator::ToLocal(uint64_t PeerTime) const { return static_cast<uint64_t>(static_cast<int64_t>(PeerTime) - Offset()); }
+
 FilePieces::FilePieces(void) : Runs{0} {}
 
 FilePieces::FilePieces(uint64_t Size) : Runs{0, Size} {}
@@ -82,10 +125,101 @@ void FilePieces::Set(uint64_t Index)
 	Runs.swap(NewRuns);
 }
 
+std::string OrderBetween(std::string const &Low, std::string const &High)
+{
+	// Digit by digit, a missing Low digit counts as 0.  While the digits so far match High the result can't go past
+	// its end, so there's no room if High is Low followed by 0 bytes; positions never end in 0 to rule that out.
+	Assert(High.empty() || (Low < High));
+	std::string Out;
+	if (High.empty() && !Low.empty())
+	{
+		// Appending is common, so count up in the first four digits rather than halving the gap each time
+		Out = Low.substr(0, 4);
+		while (Out.size() < 4) Out.push_back('\x01');
+		for (size_t Digit = 4; Digit-- > 0;)
+		{
+			if (static_cast<uint8_t>(Out[Digit]) < 0xFF)
+			{
+				Out[Digit] = static_cast<char>(static_cast<uint8_t>(Out[Digit]) + 1);
+				return Out;
+			}
+			Out[Digit] = '\x01';
+		}
+		return Low + '\x80';
+	}
+	bool Bounded = !High.empty();
+	for (size_t Digit = 0;; ++Digit)
+	{
+		if (Bounded && (Digit >= Low.size()) && (Digit >= High.size())) return {};
+		unsigned int const Below = Digit < Low.size() ? static_cast<uint8_t>(Low[Digit]) : 0;
+		unsigned int const Above = Bounded ? (Digit < High.size() ? static_cast<uint8_t>(High[Digit]) : 0) : 256;
+		Assert(Above >= Below);
+		if (Above - Below > 1)
+		{
+			Out.push_back(static_cast<char>(Below + (Above - Below) / 2));
+			return Out;
+		}
+		if (Above != Below) Bounded = false;
+		Out.push_back(static_cast<char>(Below));
+	}
+}
+
+bool ValidPosition(std::string const &Position)
+	{ return !Position.empty() && (Position.back() != '\0'); }
+
+static void OrderSpreadInto(std::string const &Low, std::string const &High, size_t Count, std::vector<std::string> &Out)
+{
+	if (Count == 0) return;
+	auto const Middle = OrderBetween(Low, High);
+	if (Middle.empty())
+	{
+		Out.insert(Out.end(), Count, std::string{});
+		return;
+	}
+	OrderSpreadInto(Low, Middle, Count / 2, Out);
+	Out.push_back(Middle);
+	OrderSpreadInto(Middle, High, Count - Count / 2 - 1, Out);
+}
+
+std::vector<std::string> OrderSpread(std::string const &Low, std::string const &High, size_t Count)
+{
+	std::vector<std::string> Out;
+	Out.reserve(Count);
+	OrderSpreadInto(Low, High, Count, Out);
+	return Out;
+}
+
+bool OrderState::Merge(HashT const &MediaID, OrderEntry const &Entry)
+{
+	Clock = std::max(Clock, Entry.Clock);
+	auto Found = Entries.find(MediaID);
+	if ((Found != Entries.end()) &&
+		(std::make_tuple(Entry.Clock, Entry.InstanceID) <= std::make_tuple(Found->second.Clock, Found->second.InstanceID)))
+		return false;
+	Entries[MediaID] = Entry;
+	if (Entry.Position > LastPosition) LastPosition = Entry.Position;
+	return true;
+}
+
 CoreConnection::CoreConnection(Core &Parent, std::string const &Host, uint16_t Port, uv_tcp_t *Watcher, std::function<void(CoreConnection &Socket)> const &ReadCallback) :
-	Network<CoreConnection>::Connection{Host, Port, Watcher, ReadCallback, *this}, Parent(Parent), SentPlayState{false}
+	Network<CoreConnection>::Connection{Host, Port, Watcher, ReadCallback, *this}, Parent(Parent), SentPlayState{false}, PlayStateWaitOver{false}
 {
 	if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("Established connection to ^0:^1", Host, Port));
+	Send(NP1V1Request{}, VersionProbe, uint64_t{*NP1V2::ID});
+	PlayStateWait = Parent.Schedule(2.0f, [this](void)
+	{
+		PlayStateWaitOver = true;
+		WakeIdleWrite();
+	});
+}
+
+CoreConnection::~CoreConnection(void)
+{
+	Parent.Cancel(PlayStateWait);
+	for (auto const &Pending : PendingRequests)
+		if (Pending.File) fclose(Pending.File);
+	if (Request.File) fclose(Request.File);
+	if (Response.File) fclose(Response.File);
 }
 
 bool CoreConnection::IdleWrite(void)
@@ -93,29 +227,40 @@ bool CoreConnection::IdleWrite(void)
 	if (!SentPlayState)
 	{
 		// There could be a race condition with user play or incoming plays being double sent, but it shouldn't affect much
-		if (Parent.Last.Playing)
+		if (!Parent.Last.Playing) SentPlayState = true;
+		else if ((Clock.Count() > 0) || PlayStateWaitOver)
+		{
+			// The peer translates the start time with its clock offset estimate, so this waits for the first exchange
+			// unless the peer doesn't do clock requests
 			Send(NP1V1Play{}, Parent.Last.MediaID, Parent.Last.MediaTime, Parent.Last.SystemTime);
-		SentPlayState = true;
+			SentPlayState = true;
+		}
 	}
 
 	if (!Announce.empty())
 	{
 		if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("Announcing ^0 size ^1", FormatHash(Announce.front().ID), Announce.front().Size));
 		Send(NP1V1Prepare{}, Announce.front().ID, Announce.front().Extension, Announce.front().Size, Announce.front().DefaultTitle);
+		auto const Tags = Parent.Tags.find(Announce.front().ID);
+		if (Tags != Parent.Tags.end())
+			Send(NP1V2Tags{}, Tags->first, Tags->second.Track, Tags->second.Artist, Tags->second.Album, Tags->second.Title, Tags->second.Duration);
+		auto const Order = Parent.Order.Entries.find(Announce.front().ID);
+		if (Order != Parent.Order.Entries.end())
+			Send(NP1V2Order{}, Order->first, Order->second.Position, Order->second.Clock, Order->second.InstanceID);
 		Announce.pop();
 		return true;
 	}
 
-	if (RequestNext()) return true;
+	if (!Request.File && RequestNext()) return true; // Don't abandon a transfer in progress
 
 	if (Response.File && !feof(Response.File))
 	{
-		std::vector<uint8_t> Data(ChunkSize);
+		auto Buffer = std::make_shared<std::array<uint8_t, ChunkSize>>();
 		AssertE(ftell(Response.File), Response.Chunk * ChunkSize);
-		auto Read = fread(&Data[0], 1, ChunkSize, Response.File);
+		auto Read = fread(&(*Buffer)[0], 1, ChunkSize, Response.File);
 		if (Read > 0)
 		{
-			Data.resize(static_cast<size_t>(Read));
+			Protocol::ArrayView<uint8_t> const Data{&(*Buffer)[0], static_cast<size_t>(Read), Buffer}; // Sent from Buffer without copying
 			Send(NP1V1Data{}, Response.ID, Response.Chunk, Data);
 			if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("Sent ^0 chunk ^1 ^2 - ^3 (^4)", FormatHash(Response.ID), Response.Chunk, Response.Chunk * ChunkSize, Response.Chunk * ChunkSize + Data.size() - 1, Data.size()));
 			Assert((Read == ChunkSize) || (feof(Response.File)));
@@ -130,7 +275,8 @@ bool CoreConnection::IdleWrite(void)
 
 void CoreConnection::HandleTimer(uint64_t const &Now)
 {
-	Send(NP1V1Clock{}, Parent.ID, Now);
+	SendDroppable(NP1V1Clock{}, Parent.ID, Now);
+	SendDroppable(NP1V2ClockRequest{}, Now);
 
 	if (Request.File && ((GetNow() - Request.LastResponse) > 10 * 1000))
 	{
@@ -144,13 +290,20 @@ void CoreConnection::HandleTimer(uint64_t const &Now)
 		}
 	}
 
+	if (Parent.LogCallback)
+	{
+		auto const &Stats = GetWriteStats();
+		Parent.LogCallback(Core::Debug, Local("Sent ^0 messages in ^1 writes (^2 bytes), dropped ^3, ^4 bytes queued", Stats.Messages, Stats.Writes, Stats.Bytes, Stats.Dropped, QueuedBytes()));
+	}
 	if (Parent.LogCallback) Parent.LogCallback(Core::Useless, Local("Ran timer event."));
 }
 
 void CoreConnection::Handle(NP1V1Clock, uint64_t const &InstanceID, uint64_t const &SystemTime)
 {
-	Parent.Net.Forward(NP1V1Clock{}, *this, InstanceID, SystemTime);
-	if (Parent.ClockCallback) Parent.ClockCallback(InstanceID, SystemTime);
+	// Times are translated into the local clock as they arrive, so over several hops this becomes the total transit time
+	auto const LocalTime = Clock.ToLocal(SystemTime);
+	Parent.Net.ForwardDroppable(NP1V1Clock{}, *this, InstanceID, LocalTime);
+	if (Parent.ClockCallback) Parent.ClockCallback(InstanceID, LocalTime);
 	if (Parent.LogCallback) Parent.LogCallback(Core::Useless, Local("Recieved clock."));
 }
 
@@ -161,14 +314,29 @@ void CoreConnection::Handle(NP1V1Prepare, HashT const &MediaID, std::string cons
 	if (Found != Parent.Library.end()) return;
 	if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("Preparing ^0 size ^1", FormatHash(MediaID), Size));
 	Parent.Net.Forward(NP1V1Prepare{}, *this, MediaID, Extension, Size, DefaultTitle);
-	PendingRequests.emplace(MediaID, Extension, Size, DefaultTitle);
-	if (Request.Pieces.Finished())
-		RequestNext();
+	if (Request.File && (Request.ID == MediaID)) return;
+	for (auto const &Pending : PendingRequests) if (Pending.ID == MediaID) return;
+	PendingRequests.emplace_back(MediaID, Extension, Size, DefaultTitle);
+	Reprioritize();
 }
 
 void CoreConnection::Handle(NP1V1Request, HashT const &MediaID, uint64_t const &From)
 {
 	if (Parent.LogCallback) Parent.LogCallback(Core::Useless, Local("Recieved request."));
+	if (MediaID == VersionProbe)
+	{
+		if (GetPeerVersion() >= *NP1V2::ID) return;
+		SetPeerVersion(static_cast<Protocol::VersionIDT::Type>(std::min(From, uint64_t{*NP1V2::ID})));
+		if (GetPeerVersion() < *NP1V2::ID) return;
+		if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("^0:^1 reads version ^2", GetHost(), GetPort(), From));
+		// Catch up on what was skipped until now; anything still to be announced is sent with the announcement
+		Send(NP1V2ClockRequest{}, GetNow());
+		for (auto const &Tags : Parent.Tags)
+			Send(NP1V2Tags{}, Tags.first, Tags.second.Track, Tags.second.Artist, Tags.second.Album, Tags.second.Title, Tags.second.Duration);
+		for (auto const &Order : Parent.Order.Entries)
+			Send(NP1V2Order{}, Order.first, Order.second.Position, Order.second.Clock, Order.second.InstanceID);
+		return;
+	}
 	auto Out = Parent.Library.find(MediaID);
 	if (Out == Parent.Library.end()) return;
 	if (!Response.File || (MediaID != Response.ID))
@@ -191,7 +359,7 @@ void CoreConnection::Handle(NP1V1Request, HashT const &MediaID, uint64_t const &
 	WakeIdleWrite();
 }
 
-void CoreConnection::Handle(NP1V1Data, HashT const &MediaID, uint64_t const &Chunk, std::vector<uint8_t> const &Bytes)
+void CoreConnection::Handle(NP1V1Data, HashT const &MediaID, uint64_t const &Chunk, Protocol::ArrayView<uint8_t> const &Bytes)
 {
 	if (Parent.LogCallback) Parent.LogCallback(Core::Useless, Local("Recieved ^0 chunk ^1 ^2 - ^3 (^4)", FormatHash(MediaID), Chunk, Chunk * ChunkSize, Chunk * ChunkSize + Bytes.size() - 1, Bytes.size()));
 	if (MediaID != Request.ID) return;
@@ -200,8 +368,14 @@ void CoreConnection::Handle(NP1V1Data, HashT const &MediaID, uint64_t const &Chu
 	AssertE(ftell(Request.File), Chunk * ChunkSize);
 	if ((Bytes.size() != ChunkSize) && (Chunk * ChunkSize + Bytes.size() != Request.Size)) return; // Probably an error condition
 	Request.Pieces.Set(Chunk);
-	fwrite(&Bytes[0], Bytes.size(), 1, Request.File);
+	fwrite(Bytes.Data, Bytes.size(), 1, Request.File);
 	Request.LastResponse = GetNow();
+	if (!Request.Pieces.Finished() && (Request.Pieces.Next() % ProgressChunks == 0))
+	{
+		// Make it readable for playback while the rest arrives
+		fflush(Request.File);
+		if (Parent.ProgressCallback) Parent.ProgressCallback(Request.ID, Request.Pieces.Next() * ChunkSize);
+	}
 	if (Request.Pieces.Finished())
 	{
 		fclose(Request.File);
@@ -222,14 +396,16 @@ void CoreConnection::Handle(NP1V1Remove, HashT const &MediaID)
 	Parent.RemoveInternal(MediaID);
 }
 
-void CoreConnection::Handle(NP1V1Play, HashT const &MediaID, MediaTimeT const &MediaTime, uint64_t const &SystemTime)
+void CoreConnection::Handle(NP1V1Play, HashT const &MediaID, MediaTimeT const &MediaTime, uint64_t const &PeerSystemTime)
 {
 	if (Parent.LogCallback) Parent.LogCallback(Core::Useless, Local("Recieved play."));
+	auto const SystemTime = Clock.ToLocal(PeerSystemTime);
 	Parent.Net.Forward(NP1V1Play{}, *this, MediaID, MediaTime, SystemTime);
 	Parent.Last.Playing = true;
 	Parent.Last.MediaID = MediaID;
 	Parent.Last.MediaTime = MediaTime;
 	Parent.Last.SystemTime = SystemTime;
+	Parent.Reprioritize();
 	if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("Received play for ^0:^1 starting at ^2", FormatHash(MediaID), MediaTime, SystemTime));
 	if (Parent.PlayCallback) Parent.PlayCallback(MediaID, MediaTime, SystemTime);
 }
@@ -249,43 +425,145 @@ void CoreConnection::Handle(NP1V1Chat, std::string const &Message)
 	if (Parent.ChatCallback) Parent.ChatCallback(Message);
 }
 
+void CoreConnection::Handle(NP1V2ClockRequest, uint64_t const &RequestSent)
+{
+	auto const Now = GetNow();
+	Send(NP1V2ClockResponse{}, RequestSent, Now, Now);
+}
+
+void CoreConnection::Handle(NP1V2ClockResponse, uint64_t const &RequestSent, uint64_t const &RequestReceived, uint64_t const &ResponseSent)
+{
+	auto const First = Clock.Count() == 0;
+	Clock.Add(RequestSent, RequestReceived, ResponseSent, GetNow());
+	if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("Clock offset to ^0:^1 is ^2ms, round trip ^3ms", GetHost(), GetPort(), Clock.Offset(), Clock.Delay()));
+	if (First && (Clock.Count() > 0)) WakeIdleWrite(); // For the held play state
+	if (Clock.Count() < 4) Send(NP1V2ClockRequest{}, GetNow()); // Get a usable estimate quickly after connecting
+}
+
+void CoreConnection::Handle(NP1V2Tags, HashT const &MediaID, uint16_t const &Track, std::string const &Artist, std::string const &Album, std::string const &Title, uint64_t const &Duration)
+{
+	MediaTags Tags;
+	Tags.Track = Track;
+	Tags.Artist = Artist;
+	Tags.Album = Album;
+	Tags.Title = Title;
+	Tags.Duration = Duration;
+	if (!Parent.Known(MediaID)) return;
+	auto Found = Parent.Tags.find(MediaID);
+	if ((Found != Parent.Tags.end()) && (Found->second == Tags)) return; // Already seen, stops loops
+	Parent.Tags[MediaID] = Tags;
+	Parent.Net.Forward(NP1V2Tags{}, *this, MediaID, Track, Artist, Album, Title, Duration);
+	if (Parent.TagsCallback) Parent.TagsCallback(MediaID, Tags);
+}
+
+void CoreConnection::Handle(NP1V2Position, uint64_t const &InstanceID, HashT const &MediaID, MediaTimeT const &MediaTime, uint64_t const &PeerSystemTime)
+{
+	auto const SystemTime = Clock.ToLocal(PeerSystemTime);
+	Parent.Net.ForwardDroppable(NP1V2Position{}, *this, InstanceID, MediaID, MediaTime, SystemTime);
+	if (Parent.PositionCallback) Parent.PositionCallback(InstanceID, MediaID, MediaTime, SystemTime);
+}
+
+void CoreConnection::Handle(NP1V2Order, HashT const &MediaID, std::string const &Position, uint64_t const &Clock, uint64_t const &InstanceID)
+{
+	if (!ValidPosition(Position)) return;
+	if (!Parent.Known(MediaID)) return; // Removed, or arrived before its announcement
+	if (!Parent.Order.Merge(MediaID, {Position, Clock, InstanceID})) return; // Already seen or stale, stops loops
+	Parent.Net.Forward(NP1V2Order{}, *this, MediaID, Position, Clock, InstanceID);
+	if (Parent.OrderCallback) Parent.OrderCallback(MediaID, Position);
+}
+
 bool CoreConnection::RequestNext(void)
 {
 	while (!PendingRequests.empty())
 	{
+		// Most wanted first, then in announce order
+		auto Next = PendingRequests.begin();
+		auto NextRank = Parent.Rank(Next->ID);
+		for (auto Candidate = std::next(Next); (NextRank > 0) && (Candidate != PendingRequests.end()); ++Candidate)
 		{
-			auto Found = Parent.Library.find(PendingRequests.front().ID);
-			if (Found != Parent.Library.end())
-			{
-				PendingRequests.pop();
-				continue;
-			}
+			auto const Rank = Parent.Rank(Candidate->ID);
+			if (Rank >= NextRank) continue;
+			Next = Candidate;
+			NextRank = Rank;
 		}
-		Request.ID = PendingRequests.front().ID;
-		Request.Size = PendingRequests.front().Size;
-		Request.Pieces = {1 + ((Request.Size - 1) / ChunkSize)};
+		auto const Info = *Next;
+		PendingRequests.erase(Next);
+
+		if (Parent.Library.find(Info.ID) != Parent.Library.end())
+		{
+			if (Info.File) fclose(Info.File);
+			continue;
+		}
+		Request.ID = Info.ID;
+		Request.Size = Info.Size;
 		Request.Attempts = 0;
-		Request.DefaultTitle = PendingRequests.front().DefaultTitle;
-		Request.Path = Parent.TempPath->Enter(FormatHash(Request.ID) + PendingRequests.front().Extension);
+		Request.Extension = Info.Extension;
+		Request.DefaultTitle = Info.DefaultTitle;
+		Request.Path = Parent.TempPath->Enter(FormatHash(Request.ID) + Info.Extension);
 		if (Request.File) { fclose(Request.File); Request.File = nullptr; }
-		Request.File = Filesystem::fopen_write(Request.Path->Render());
-		if (!Request.File)
+		if (Info.File)
 		{
-			if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("Could not create core library file ^0", Request.Path));
-			PendingRequests.pop();
-			continue;
+			Request.Pieces = Info.Pieces;
+			Request.File = Info.File;
+		}
+		else
+		{
+			Request.Pieces = {1 + ((Request.Size - 1) / ChunkSize)};
+			Request.File = Filesystem::fopen_write(Request.Path->Render());
+			if (!Request.File)
+			{
+				if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("Could not create core library file ^0", Request.Path));
+				continue;
+			}
 		}
 		if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("Requesting ^0 from chunk ^1", FormatHash(Request.ID), Request.Pieces.Next()));
 		Send(NP1V1Request{}, Request.ID, Request.Pieces.Next());
-		PendingRequests.pop();
+		if (Parent.ReceivingCallback) Parent.ReceivingCallback(Request.ID, Request.Path, Request.Size, Request.DefaultTitle);
 		return true;
 	}
 	return false;
 }
 
+void CoreConnection::Reprioritize(void)
+{
+	if (!Request.File)
+	{
+		RequestNext();
+		return;
+	}
+
+	auto const Current = Parent.Rank(Request.ID);
+	if (Current == 0) return;
+	bool Preempt = false;
+	for (auto const &Pending : PendingRequests)
+		if (Parent.Rank(Pending.ID) < Current) { Preempt = true; break; }
+	if (!Preempt) return;
+
+	// Put it back in front of anything of equal priority, keeping what's arrived so far
+	if (Parent.LogCallback) Parent.LogCallback(Core::Debug, Local("Pausing transfer of ^0 at chunk ^1 for more wanted media", FormatHash(Request.ID), Request.Pieces.Next()));
+	fflush(Request.File);
+	PendingRequests.emplace_front(Request.ID, Request.Extension, Request.Size, Request.DefaultTitle);
+	PendingRequests.front().File = Request.File;
+	PendingRequests.front().Pieces = Request.Pieces;
+	Request.File = nullptr;
+	RequestNext();
+}
+
 void CoreConnection::Remove(HashT const &MediaID)
 {
-	if (Request.ID == MediaID) RequestNext();
+	for (auto Pending = PendingRequests.begin(); Pending != PendingRequests.end();)
+	{
+		if (Pending->ID != MediaID) { ++Pending; continue; }
+		if (Pending->File) fclose(Pending->File);
+		Pending = PendingRequests.erase(Pending);
+	}
+	if (Request.File && (Request.ID == MediaID))
+	{
+		fclose(Request.File);
+		Request.File = nullptr;
+		Request.ID = HashT{};
+		RequestNext();
+	}
 	if ((Response.ID == MediaID) && (Response.File)) { fclose(Response.File); Response.File = nullptr; }
 }
 
@@ -296,7 +574,7 @@ Core::Core(bool PruneOldItems) :
 	Last{false},
 	Net
 	{
-		std::make_tuple(NP1V1Clock{}, NP1V1Prepare{}, NP1V1Request{}, NP1V1Data{}, NP1V1Remove{}, NP1V1Play{}, NP1V1Stop{}, NP1V1Chat{}),
+		std::make_tuple(NP1V1Clock{}, NP1V1Prepare{}, NP1V1Request{}, NP1V1Data{}, NP1V1Remove{}, NP1V1Play{}, NP1V1Stop{}, NP1V1Chat{}, NP1V2ClockRequest{}, NP1V2ClockResponse{}, NP1V2Tags{}, NP1V2Position{}, NP1V2Order{}),
 		[this](std::string const &Host, uint16_t Port, uv_tcp_t *Watcher, std::function<void(CoreConnection &Socket)> const &ReadCallback) // Create connection
 		{
 			auto IdleTime = Net.IdleSince();
@@ -311,7 +589,7 @@ Core::Core(bool PruneOldItems) :
 				for (auto const &Hash : Removing)
 				{
 					if (RemoveCallback) RemoveCallback(Hash);
-					Library.erase(Hash);
+					RemoveInternal(Hash);
 				}
 				TempPath->Delete();
 				TempPath->CreateDirectory();
@@ -343,14 +621,24 @@ void Core::Open(bool Listen, std::string const &Host, uint16_t Port)
 	Net.Open(Listen, Host, Port);
 }
 
-void Core::Transfer(std::function<void(void)> const &Call)
+void Core::Transfer(CallT &&Call)
+{
+	Net.Transfer(std::move(Call));
+}
+
+TimerWheel::HandleT Core::Schedule(float Seconds, CallT &&Call)
+{
+	return Net.Schedule(Seconds, std::move(Call));
+}
+
+bool Core::Cancel(TimerWheel::HandleT const &Timer)
 {
-	Net.Transfer(Call);
+	return Net.Cancel(Timer);
 }
 
-void Core::Schedule(float Seconds, std::function<void(void)> const &Call)
+bool Core::Pending(TimerWheel::HandleT const &Timer) const
 {
-	Net.Schedule(Seconds, Call);
+	return Net.Pending(Timer);
 }
 
 void Core::Add(HashT const &MediaID, size_t Size, PathT const &Path)
@@ -358,6 +646,7 @@ void Core::Add(HashT const &MediaID, size_t Size, PathT const &Path)
 	try
 	{
 		Library.emplace(MediaID, LibraryInfo{Size, Path, Path->Filename()});
+		if (Order.Entries.find(MediaID) == Order.Entries.end()) Reorder({{MediaID, OrderBetween(Order.LastPosition, {})}});
 
 		for (auto &Connection : Net.GetConnections())
 		{
@@ -383,6 +672,7 @@ void Core::Play(HashT const &MediaID, MediaTimeT Position, uint64_t SystemTime)
 	Last.MediaID = MediaID;
 	Last.MediaTime = Position;
 	Last.SystemTime = SystemTime;
+	Reprioritize();
 }
 
 void Core::Stop(void)
@@ -394,14 +684,87 @@ void Core::Stop(void)
 void Core::Chat(std::string const &Message)
 	{ Net.Broadcast(NP1V1Chat{}, Message); }
 
+void Core::Position(HashT const &MediaID, MediaTimeT MediaTime, uint64_t SystemTime)
+	{ Net.BroadcastDroppable(NP1V2Position{}, ID, MediaID, MediaTime, SystemTime); }
+
+void Core::SetTags(HashT const &MediaID, MediaTags const &Tags)
+{
+	auto Found = this->Tags.find(MediaID);
+	if ((Found != this->Tags.end()) && (Found->second == Tags)) return;
+	this->Tags[MediaID] = Tags;
+	Net.Broadcast(NP1V2Tags{}, MediaID, Tags.Track, Tags.Artist, Tags.Album, Tags.Title, Tags.Duration);
+}
+
+void Core::Prioritize(std::vector<HashT> const &MediaIDs)
+{
+	Priorities.clear();
+	for (size_t Index = 0; Index < MediaIDs.size(); ++Index) Priorities.emplace(MediaIDs[Index], Index + 1);
+	Reprioritize();
+}
+
+void Core::Reorder(std::vector<OrderPosition> const &Positions)
+{
+	for (auto const &Moved : Positions)
+	{
+		if (!ValidPosition(Moved.Position)) continue;
+		++Order.Clock;
+		Order.Merge(Moved.MediaID, {Moved.Position, Order.Clock, ID});
+		Net.Broadcast(NP1V2Order{}, Moved.MediaID, Moved.Position, Order.Clock, ID);
+		// Echoed so the front end settles on the same result as everyone else if it raced a remote change
+		if (OrderCallback) OrderCallback(Moved.MediaID, Moved.Position);
+	}
+}
+
+void Core::Restore(HashT const &MediaID, MediaTags const &Tags, std::string const &Position)
+{
+	this->Tags[MediaID] = Tags;
+	if (!ValidPosition(Position)) return;
+	if (Order.Entries.find(MediaID) != Order.Entries.end()) return;
+	Order.Merge(MediaID, {Position, 0, ID});
+}
+
 Core::PlayStatus const &Core::GetPlayStatus(void) const
 	{ return Last; }
 
+std::string Core::GetPosition(HashT const &MediaID) const
+{
+	auto Found = Order.Entries.find(MediaID);
+	if (Found == Order.Entries.end()) return {};
+	return Found->second.Position;
+}
+
 void Core::RemoveInternal(HashT const &MediaID)
 {
-	auto Out = Library.find(MediaID);
-	if (Out == Library.end()) return;
-	Library.erase(Out);
-	for (auto &Connection : Net.GetConnections())
+	Tags.erase(MediaID);
+	Order.Entries.erase(MediaID);
+	Library.erase(MediaID);
+	for (auto &Connection : Net.GetConnections()) // Including transfers in progress
 		Connection->Remove(MediaID);
 }
+
+bool Core::Known(HashT const &MediaID)
+{
+	if (Library.find(MediaID) != Library.end()) return true;
+	for (auto &Connection : Net.GetConnections())
+	{
+		if (Connection->Request.File && (Connection->Request.ID == MediaID)) return true;
+		for (auto const &Pending : Connection->PendingRequests)
+			if (Pending.ID == MediaID) return true;
+	}
+	return false;
+}
+
+size_t Core::Rank(HashT const &MediaID) const
+{
+	if (Last.Playing && (MediaID == Last.MediaID)) return 0;
+	auto Found = Priorities.find(MediaID);
+	if (Found != Priorities.end()) return Found->second;
+	return std::numeric_limits<size_t>::max();
+}
+
+void Core::Reprioritize(void)
+{
+	for (auto &Connection : Net.GetConnections())
+		Connection->Reprioritize();
+}
+
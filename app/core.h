@@ -6,8 +6,12 @@
 #include "network.h"
 #include "hash.h"
 #include <map>
+#include <deque>
+#include <list>
+#include <queue>
 
 constexpr uint64_t ChunkSize = 512; // Set for all protocol versions
+constexpr uint64_t ProgressChunks = 64; // How often partially received media is made readable
 
 typedef StrictType(uint64_t) MediaTimeT;
 
@@ -17,12 +21,30 @@ DefineProtocolVersion(NP1V1, NetProto1)
 DefineProtocolMessage(NP1V1Clock, NP1V1, void(uint64_t InstanceID, uint64_t SystemTime))
 DefineProtocolMessage(NP1V1Prepare, NP1V1, void(HashT MediaID, std::string Extension, uint64_t Size, std::string DefaultTitle))
 DefineProtocolMessage(NP1V1Request, NP1V1, void(HashT MediaID, uint64_t From))
-DefineProtocolMessage(NP1V1Data, NP1V1, void(HashT MediaID, uint64_t Chunk, std::vector<uint8_t> Bytes))
+DefineProtocolMessage(NP1V1Data, NP1V1, void(HashT MediaID, uint64_t Chunk, Protocol::ArrayView<uint8_t> Bytes))
 DefineProtocolMessage(NP1V1Remove, NP1V1, void(HashT MediaID))
 DefineProtocolMessage(NP1V1Play, NP1V1, void(HashT MediaID, MediaTimeT MediaTime, uint64_t SystemTime))
 DefineProtocolMessage(NP1V1Stop, NP1V1, void(void))
 DefineProtocolMessage(NP1V1Chat, NP1V1, void(std::string Message))
 
+// Readers before NP1V2 drop the connection on messages from later versions, so these are only sent to peers that have
+// said they read them.  Peers say so with an NP1V1Request for VersionProbe, with From the highest version they read.
+// Older peers ignore it, since it's not media they have.
+extern HashT const VersionProbe;
+
+DefineProtocolVersion(NP1V2, NetProto1)
+// Point to point, not forwarded.  Times are in the local clock of whoever wrote them.
+DefineProtocolMessage(NP1V2ClockRequest, NP1V2, void(uint64_t RequestSent))
+DefineProtocolMessage(NP1V2ClockResponse, NP1V2, void(uint64_t RequestSent, uint64_t RequestReceived, uint64_t ResponseSent))
+// Forwarded.  Tags as parsed by whoever has the file, so peers can list media before it arrives.  Track and Duration
+// (ms) are 0 if unknown.
+DefineProtocolMessage(NP1V2Tags, NP1V2, void(HashT MediaID, uint16_t Track, std::string Artist, std::string Album, std::string Title, uint64_t Duration))
+// Forwarded.  Where an instance's playback actually was at a time, for measuring drift from the agreed timeline.
+DefineProtocolMessage(NP1V2Position, NP1V2, void(uint64_t InstanceID, HashT MediaID, MediaTimeT MediaTime, uint64_t SystemTime))
+// Forwarded.  Where media goes in the shared playlist, which is ordered by Position then MediaID.  For each media the
+// write with the highest (Clock, InstanceID) wins; Clock is a Lamport clock.
+DefineProtocolMessage(NP1V2Order, NP1V2, void(HashT MediaID, std::string Position, uint64_t Clock, uint64_t InstanceID))
+
 struct FilePieces
 {
 	FilePieces(void);
@@ -36,6 +58,70 @@ struct FilePieces
 	std::vector<uint64_t> Runs;
 };
 
+// Estimates a peer's clock offset from request/response timestamp exchanges, NTP style
+struct ClockEstimator
+{
+	void Add(uint64_t RequestSent, uint64_t RequestReceived, uint64_t ResponseSent, uint64_t ResponseReceived);
+	size_t Count(void) const;
+	int64_t Offset(void) const; // Peer clock minus local clock, ms
+	uint64_t Delay(void) const; // Round trip time of the sample the offset came from, ms
+
+	uint64_t ToLocal(uint64_t PeerTime) const;
+
+	private:
+		struct Sample
+		{
+			int64_t Offset;
+			uint64_t Delay;
+		};
+		std::deque<Sample> Samples;
+		size_t BestIndex = 0;
+};
+
+struct MediaTags
+{
+	uint16_t Track = 0; // 0 if unknown
+	std::string Artist;
+	std::string Album;
+	std::string Title;
+	uint64_t Duration = 0; // ms, 0 if unknown
+
+	bool operator ==(MediaTags const &Other) const;
+	bool operator !=(MediaTags const &Other) const;
+};
+
+// Shared playlist positions are byte strings compared lexicographically, so there's always room for another between
+// any two.  Empty means unplaced.  They never end in a 0 byte, since nothing sorts between a string and itself followed
+// by 0 bytes.
+struct OrderPosition
+{
+	HashT MediaID;
+	std::string Position;
+};
+
+// A position after Low and before High; either can be empty for no bound.  Empty if there's no room, which only happens
+// if High ends in a 0 byte.
+std::string OrderBetween(std::string const &Low, std::string const &High);
+// Count evenly spread positions between Low and High, in order; empty where there's no room
+std::vector<std::string> OrderSpread(std::string const &Low, std::string const &High, size_t Count);
+// Nonempty and not ending in a 0 byte, so there's always room before it
+bool ValidPosition(std::string const &Position);
+
+// Each item's position is last writer wins: the higher Lamport clock, then the higher instance ID on a tie
+struct OrderEntry
+{
+	std::string Position;
+	uint64_t Clock;
+	uint64_t InstanceID;
+};
+struct OrderState
+{
+	std::map<HashT, OrderEntry> Entries;
+	uint64_t Clock = 0; // Highest seen
+	std::string LastPosition; // Highest seen, for appending
+	bool Merge(HashT const &MediaID, OrderEntry const &Entry); // False if it's not newer than what's known
+};
+
 struct Core;
 
 struct CoreConnection : Network<CoreConnection>::Connection
@@ -43,6 +129,8 @@ struct CoreConnection : Network<CoreConnection>::Connection
 	Core &Parent;
 
 	bool SentPlayState;
+	bool PlayStateWaitOver; // Set if no clock sample arrived in time to translate the play state with
+	TimerWheel::HandleT PlayStateWait;
 
 	struct MediaInfo
 	{
@@ -50,6 +138,9 @@ struct CoreConnection : Network<CoreConnection>::Connection
 		std::string Extension;
 		uint64_t Size;
 		std::string DefaultTitle;
+		// Set if the transfer was paused for more wanted media, to carry on from where it stopped
+		FILE *File = nullptr;
+		FilePieces Pieces;
 		MediaInfo(HashT const &ID, std::string const &Extension, uint64_t const &Size, std::string const &DefaultTitle) : ID(ID), Extension{Extension}, Size{Size}, DefaultTitle{DefaultTitle} {}
 	};
 
@@ -64,9 +155,10 @@ struct CoreConnection : Network<CoreConnection>::Connection
 		PathT Path;
 		FILE *File = nullptr;
 		unsigned int Attempts;
+		std::string Extension;
 		std::string DefaultTitle;
 	} Request;
-	std::queue<MediaInfo> PendingRequests;
+	std::list<MediaInfo> PendingRequests; // Requested by priority, see Core::Rank
 
 	struct
 	{
@@ -75,7 +167,10 @@ struct CoreConnection : Network<CoreConnection>::Connection
 		uint64_t Chunk;
 	} Response;
 
+	ClockEstimator Clock;
+
 	CoreConnection(Core &Parent, std::string const &Host, uint16_t Port, uv_tcp_t *Watcher, std::function<void(CoreConnection &Socket)> const &ReadCallback);
+	~CoreConnection(void);
 
 	bool IdleWrite(void);
 
@@ -83,13 +178,19 @@ struct CoreConnection : Network<CoreConnection>::Connection
 	void Handle(NP1V1Clock, uint64_t const &InstanceID, uint64_t const &SystemTime);
 	void Handle(NP1V1Prepare, HashT const &MediaID, std::string const &Extension, uint64_t const &Size, std::string const &DefaultTitle);
 	void Handle(NP1V1Request, HashT const &MediaID, uint64_t const &From);
-	void Handle(NP1V1Data, HashT const &MediaID, uint64_t const &Chunk, std::vector<uint8_t> const &Bytes);
+	void Handle(NP1V1Data, HashT const &MediaID, uint64_t const &Chunk, Protocol::ArrayView<uint8_t> const &Bytes);
 	void Handle(NP1V1Remove, HashT const &MediaID);
 	void Handle(NP1V1Play, HashT const &MediaID, MediaTimeT const &MediaTime, uint64_t const &SystemTime);
 	void Handle(NP1V1Stop);
 	void Handle(NP1V1Chat, std::string const &Message);
+	void Handle(NP1V2ClockRequest, uint64_t const &RequestSent);
+	void Handle(NP1V2ClockResponse, uint64_t const &RequestSent, uint64_t const &RequestReceived, uint64_t const &ResponseSent);
+	void Handle(NP1V2Tags, HashT const &MediaID, uint16_t const &Track, std::string const &Artist, std::string const &Album, std::string const &Title, uint64_t const &Duration);
+	void Handle(NP1V2Position, uint64_t const &InstanceID, HashT const &MediaID, MediaTimeT const &MediaTime, uint64_t const &SystemTime);
+	void Handle(NP1V2Order, HashT const &MediaID, std::string const &Position, uint64_t const &Clock, uint64_t const &InstanceID);
 
 	bool RequestNext(void);
+	void Reprioritize(void); // Switches to higher priority media if the current request isn't the most wanted
 
 	void Remove(HashT const &MediaID);
 };
@@ -109,17 +210,29 @@ struct Core : CallTransferType
 
 	// Any thread
 	void Open(bool Listen, std::string const &Host, uint16_t Port);
-	void Transfer(std::function<void(void)> const &Call) override;
-	void Schedule(float Seconds, std::function<void(void)> const &Call);
+	void Transfer(CallT &&Call) override;
 
 	// Core thread only
+	TimerWheel::HandleT Schedule(float Seconds, CallT &&Call);
+	bool Cancel(TimerWheel::HandleT const &Timer); // False if it already ran or was cancelled
+	bool Pending(TimerWheel::HandleT const &Timer) const;
 	void Add(HashT const &MediaID, size_t Size, PathT const &Path);
 	void Remove(HashT const &MediaID);
 	void Play(HashT const &MediaID, MediaTimeT Position, uint64_t SystemTime);
 	void Stop(void);
 	void Chat(std::string const &Message);
+	void Position(HashT const &MediaID, MediaTimeT MediaTime, uint64_t SystemTime);
+	void SetTags(HashT const &MediaID, MediaTags const &Tags);
+	// Media to fetch first, most wanted first.  Whatever's playing always comes before these.
+	void Prioritize(std::vector<HashT> const &MediaIDs);
+	// Moves media in the shared playlist.  Media added locally is placed at the end automatically.
+	void Reorder(std::vector<OrderPosition> const &Positions);
+	// Tags and a position saved from an earlier session, kept without broadcasting; call before Add, whose
+	// announcement carries them.  Any position set since, here or by a peer, takes precedence.
+	void Restore(HashT const &MediaID, MediaTags const &Tags, std::string const &Position);
 
 	PlayStatus const &GetPlayStatus(void) const;
+	std::string GetPosition(HashT const &MediaID) const; // Empty if unplaced
 
 	// Callbacks
 	enum LogPriority { Important, Unimportant, Debug, Useless };
@@ -127,15 +240,24 @@ struct Core : CallTransferType
 
 	std::function<void(uint64_t InstanceID, uint64_t const &SystemTime)> ClockCallback;
 	std::function<void(HashT const &MediaID, PathT const &Path, std::string const &DefaultTitle)> AddCallback;
+	// While media is arriving: when it starts, and whenever more of the start of the file is readable from Path
+	std::function<void(HashT const &MediaID, PathT const &Path, uint64_t Size, std::string const &DefaultTitle)> ReceivingCallback;
+	std::function<void(HashT const &MediaID, uint64_t Available)> ProgressCallback;
 	std::function<void(HashT const &MediaID)> RemoveCallback;
+	std::function<void(HashT const &MediaID, MediaTags const &Tags)> TagsCallback;
 	std::function<void(HashT const &MediaID, MediaTimeT MediaTime, uint64_t const &SystemTime)> PlayCallback;
+	std::function<void(uint64_t InstanceID, HashT const &MediaID, MediaTimeT MediaTime, uint64_t const &SystemTime)> PositionCallback;
 	std::function<void(void)> StopCallback;
+	std::function<void(HashT const &MediaID, std::string const &Position)> OrderCallback; // Including local changes
 	std::function<void(std::string const &Message)> ChatCallback;
 
 	private:
 		friend struct CoreConnection;
 
 		void RemoveInternal(HashT const &MediaID);
+		bool Known(HashT const &MediaID); // In the library or being fetched
+		size_t Rank(HashT const &MediaID) const; // Lower is fetched first
+		void Reprioritize(void);
 
 		PathT const TempPath;
 		uint64_t const ID;
@@ -152,6 +274,10 @@ struct Core : CallTransferType
 			LibraryInfo(uint64_t Size, PathT const &Path, std::string const &DefaultTitle) : Size{Size}, Path{Path}, DefaultTitle{DefaultTitle} {}
 		};
 		std::map<HashT, LibraryInfo> Library;
+		std::map<HashT, MediaTags> Tags; // Includes media that hasn't arrived yet
+		std::map<HashT, size_t> Priorities;
+
+		OrderState Order;
 
 		Network<CoreConnection> Net;
 };
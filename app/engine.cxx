@@ -0,0 +1,382 @@
+#include "engine.h"
+
+#include "../ren-cxx-basics/type.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+GrowingFile::GrowingFile(PathT const &Path, uint64_t Size) : Path{Path}, Size{Size}, Available{0}, Cancelled{false}, Interrupts{0} {}
+
+void GrowingFile::SetAvailable(uint64_t Available)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		this->Available = std::min(Available, Size);
+	}
+	Changed.notify_all();
+}
+
+void GrowingFile::Cancel(void)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		Cancelled = true;
+	}
+	Changed.notify_all();
+}
+
+void GrowingFile::Interrupt(void)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		++Interrupts;
+	}
+	Changed.notify_all();
+}
+
+PathT const &GrowingFile::GetPath(void) const { return Path; }
+
+uint64_t GrowingFile::GetSize(void) const { return Size; }
+
+OptionalT<uint64_t> GrowingFile::WaitFor(uint64_t Offset)
+{
+	if (Offset >= Size) return uint64_t{0};
+	std::unique_lock<std::mutex> Lock(Mutex);
+	auto const StartInterrupts = Interrupts;
+	Changed.wait_for(Lock, std::chrono::seconds(30), [&](void) { return Cancelled || (Interrupts != StartInterrupts) || (Available > Offset); });
+	if (Cancelled || (Available <= Offset)) return {};
+	return Available - Offset;
+}
+
+AudioEngine::Media::~Media(void) {}
+
+AudioEngine::~AudioEngine(void) {}
+
+std::unique_ptr<AudioEngine> CreateEngine(EngineType Type, CallTransferType &CallTransfer)
+{
+	switch (Type)
+	{
+		case EngineType::VLC: return std::make_unique<VLCEngine>(CallTransfer);
+		case EngineType::Null: return std::make_unique<NullEngine>(CallTransfer);
+		default: assert(false); return {};
+	}
+}
+
+VLCEngine::VLCMedia::VLCMedia(libvlc_media_t *Media) : Media{Media} {}
+
+VLCEngine::VLCMedia::VLCMedia(void) {}
+
+VLCEngine::VLCMedia::~VLCMedia(void)
+{
+	if (File) File->Cancel(); // Unblock any reads in progress
+	if (Media) libvlc_media_release(Media);
+}
+
+VLCEngine::VLCEngine(CallTransferType &CallTransfer) : CallTransfer(CallTransfer), Players{}, CurrentIndex{0}, StopPending{false}, Prerolling{false, false, MediaTimeT{0}}
+{
+	VLC = libvlc_new(0, nullptr);
+	if (!VLC) throw ConstructionErrorT() << Local("Could not initialize libVLC: ^0", libvlc_errmsg());
+	for (auto &Slot : Players)
+	{
+		Slot.Engine = this;
+		Slot.Player = libvlc_media_player_new(VLC);
+		if (!Slot.Player) throw ConstructionErrorT() << Local("Could not initialice libVLC media player: ^0", libvlc_errmsg());
+		libvlc_event_attach(libvlc_media_player_event_manager(Slot.Player), libvlc_MediaPlayerEndReached, VLCMediaEndCallback, &Slot);
+		libvlc_event_attach(libvlc_media_player_event_manager(Slot.Player), libvlc_MediaPlayerPlaying, VLCMediaPlayingCallback, &Slot);
+	}
+}
+
+VLCEngine::~VLCEngine(void)
+{
+	for (auto &Slot : Players) if (Slot.Player) libvlc_media_player_release(Slot.Player);
+	libvlc_release(VLC);
+}
+
+std::unique_ptr<AudioEngine::Media> VLCEngine::Open(PathT const &Filename)
+{
+	auto *Media = libvlc_media_new_path(VLC, Filename->Render().c_str());
+	if (!Media) return {};
+	return std::make_unique<VLCMedia>(Media);
+}
+
+std::unique_ptr<AudioEngine::Media> VLCEngine::OpenGrowing(std::shared_ptr<GrowingFile> const &File)
+{
+	auto Out = std::make_unique<VLCMedia>();
+	Out->File = File;
+	// Players keep their own reference to the media and can open it again after Out is gone, so the callbacks get a
+	// copy that lives until VLC frees the media
+	auto Opaque = new std::shared_ptr<GrowingFile>(File);
+	Out->Media = libvlc_media_new_callbacks(VLC, GrowingOpen, GrowingRead, GrowingSeek, GrowingClose, Opaque);
+	if (!Out->Media)
+	{
+		delete Opaque;
+		return {};
+	}
+	libvlc_event_attach(libvlc_media_event_manager(Out->Media), libvlc_MediaFreed, GrowingFreed, Opaque);
+	return std::move(Out);
+}
+
+std::string VLCEngine::GetError(void) const
+{
+	auto const Message = libvlc_errmsg();
+	return Message ? Message : "";
+}
+
+MediaTimeT VLCEngine::GetDuration(Media &Item)
+{
+	auto const Duration = libvlc_media_get_duration(static_cast<VLCMedia &>(Item).Media);
+	return MediaTimeT(Duration > 0 ? Duration : 0);
+}
+
+void VLCEngine::Play(Media &Item, MediaTimeT Position)
+{
+	CancelPreroll();
+	SetMedia(Players[CurrentIndex], static_cast<VLCMedia &>(Item));
+	libvlc_media_player_play(Current());
+	libvlc_media_player_set_time(Current(), *Position);
+}
+
+void VLCEngine::Preroll(Media &Item, MediaTimeT Position)
+{
+	// Play muted until the media's open, then pause and seek; see VLCMediaPlayingCallback
+	CancelPreroll();
+	StopSpare();
+	Prerolling.Active = true;
+	Prerolling.Ready = false;
+	Prerolling.Position = Position;
+	SetMedia(Players[1 - CurrentIndex], static_cast<VLCMedia &>(Item));
+	libvlc_audio_set_mute(Spare(), 1);
+	libvlc_media_player_play(Spare());
+}
+
+void VLCEngine::Release(MediaTimeT Position)
+{
+	if (!Prerolling.Active) return;
+	Prerolling.Active = false;
+	auto const Previous = Current();
+	CurrentIndex = 1 - CurrentIndex;
+	if (Prerolling.Ready) libvlc_media_player_set_pause(Current(), 0);
+	else libvlc_media_player_set_time(Current(), *Position);
+	libvlc_media_player_set_rate(Current(), 1);
+	libvlc_audio_set_mute(Current(), 0);
+
+	// Stopping waits for the player's threads, so it's done after the handoff rather than holding it up
+	libvlc_audio_set_mute(Previous, 1);
+	StopPending = true;
+	CallTransfer([this](void) { StopSpare(); });
+}
+
+void VLCEngine::Pause(void)
+{
+	CancelPreroll();
+	libvlc_media_player_set_pause(Current(), 1);
+}
+
+bool VLCEngine::IsPlaying(void) { return libvlc_media_player_is_playing(Current()); }
+
+OptionalT<MediaTimeT> VLCEngine::GetTime(void)
+{
+	auto const Time = libvlc_media_player_get_time(Current());
+	if (Time < 0) return {};
+	return MediaTimeT(Time);
+}
+
+void VLCEngine::Seek(MediaTimeT Position) { libvlc_media_player_set_time(Current(), *Position); }
+
+void VLCEngine::SetRate(float Rate) { libvlc_media_player_set_rate(Current(), Rate); }
+
+void VLCEngine::SetVolume(float Volume)
+{
+	for (auto &Slot : Players) libvlc_audio_set_volume(Slot.Player, static_cast<int>(Volume * 100));
+}
+
+libvlc_media_player_t *VLCEngine::Current(void) { return Players[CurrentIndex].Player; }
+
+libvlc_media_player_t *VLCEngine::Spare(void) { return Players[1 - CurrentIndex].Player; }
+
+void VLCEngine::SetMedia(PlayerSlot &Slot, VLCMedia &Item)
+{
+	if (Slot.File) Slot.File->Interrupt(); // Replacing the media waits for reads in progress
+	Slot.File = Item.File;
+	libvlc_media_player_set_media(Slot.Player, Item.Media);
+}
+
+void VLCEngine::Stop(PlayerSlot &Slot)
+{
+	// Stopping waits for reads in progress, which could be waiting on a transfer that stalled
+	if (Slot.File) Slot.File->Interrupt();
+	libvlc_media_player_stop(Slot.Player);
+}
+
+void VLCEngine::StopSpare(void)
+{
+	if (!StopPending) return;
+	StopPending = false;
+	Stop(Players[1 - CurrentIndex]);
+}
+
+void VLCEngine::CancelPreroll(void)
+{
+	if (!Prerolling.Active) return;
+	Prerolling.Active = false;
+	Stop(Players[1 - CurrentIndex]);
+	libvlc_audio_set_mute(Spare(), 0);
+}
+
+void VLCEngine::VLCMediaEndCallback(libvlc_event_t const *Event, void *UserData)
+{
+	auto Slot = static_cast<PlayerSlot *>(UserData);
+	auto This = Slot->Engine;
+	This->CallTransfer([This, Slot](void)
+	{
+		if (Slot->Player != This->Current()) return;
+		if (This->EndCallback) This->EndCallback();
+	});
+}
+
+void VLCEngine::VLCMediaPlayingCallback(libvlc_event_t const *Event, void *UserData)
+{
+	auto Slot = static_cast<PlayerSlot *>(UserData);
+	auto This = Slot->Engine;
+	This->CallTransfer([This, Slot](void)
+	{
+		if (!This->Prerolling.Active || This->Prerolling.Ready || (Slot->Player != This->Spare())) return;
+		libvlc_media_player_set_pause(Slot->Player, 1);
+		libvlc_media_player_set_time(Slot->Player, *This->Prerolling.Position);
+		This->Prerolling.Ready = true;
+		if (This->PrerolledCallback) This->PrerolledCallback();
+	});
+}
+
+struct GrowingReader
+{
+	std::shared_ptr<GrowingFile> File;
+	FILE *Handle;
+	uint64_t Offset;
+};
+
+int VLCEngine::GrowingOpen(void *Opaque, void **Data, uint64_t *Size)
+{
+	auto const &File = *static_cast<std::shared_ptr<GrowingFile> *>(Opaque);
+	auto Handle = Filesystem::fopen_read(File->GetPath()->Render());
+	if (!Handle) return -1;
+	*Data = new GrowingReader{File, Handle, 0};
+	*Size = File->GetSize();
+	return 0;
+}
+
+ssize_t VLCEngine::GrowingRead(void *Data, unsigned char *Buffer, size_t Length)
+{
+	auto Reader = static_cast<GrowingReader *>(Data);
+	auto const Ready = Reader->File->WaitFor(Reader->Offset);
+	if (!Ready) return -1;
+	if (*Ready == 0) return 0;
+	clearerr(Reader->Handle); // May have hit the end of what was written before
+	auto const Read = fread(Buffer, 1, static_cast<size_t>(std::min<uint64_t>(Length, *Ready)), Reader->Handle);
+	if ((Read == 0) && ferror(Reader->Handle)) return -1;
+	Reader->Offset += Read;
+	return static_cast<ssize_t>(Read);
+}
+
+int VLCEngine::GrowingSeek(void *Data, uint64_t Offset)
+{
+	auto Reader = static_cast<GrowingReader *>(Data);
+	if (fseek(Reader->Handle, Offset, SEEK_SET) != 0) return -1;
+	Reader->Offset = Offset;
+	return 0;
+}
+
+void VLCEngine::GrowingClose(void *Data)
+{
+	auto Reader = static_cast<GrowingReader *>(Data);
+	fclose(Reader->Handle);
+	delete Reader;
+}
+
+void VLCEngine::GrowingFreed(libvlc_event_t const *Event, void *UserData)
+	{ delete static_cast<std::shared_ptr<GrowingFile> *>(UserData); }
+
+NullEngine::NullEngine(CallTransferType &CallTransfer) : Clock{GetNow}, Skew{0}, Duration{0}, CallTransfer(CallTransfer), Playing{false}, Base{0}, StartedAt{0}, Rate{1}, Prerolling{false, MediaTimeT{0}} {}
+
+std::unique_ptr<AudioEngine::Media> NullEngine::Open(PathT const &Filename) { return std::make_unique<Media>(); }
+
+std::unique_ptr<AudioEngine::Media> NullEngine::OpenGrowing(std::shared_ptr<GrowingFile> const &File) { return std::make_unique<Media>(); }
+
+std::string NullEngine::GetError(void) const { return {}; }
+
+MediaTimeT NullEngine::GetDuration(Media &Item) { return Duration; }
+
+void NullEngine::Play(Media &Item, MediaTimeT Position)
+{
+	Prerolling.Active = false;
+	Start(Position);
+}
+
+void NullEngine::Preroll(Media &Item, MediaTimeT Position)
+{
+	// Opening takes no time, and the current item plays on until the release
+	Prerolling.Active = true;
+	Prerolling.Position = Position;
+	CallTransfer([this](void)
+	{
+		if (!Prerolling.Active) return;
+		if (PrerolledCallback) PrerolledCallback();
+	});
+}
+
+void NullEngine::Release(MediaTimeT Position)
+{
+	if (!Prerolling.Active) return;
+	Prerolling.Active = false;
+	Start(Position);
+	Rate = 1;
+}
+
+void NullEngine::Pause(void)
+{
+	Prerolling.Active = false;
+	Base = **GetTime();
+	Playing = false;
+}
+
+bool NullEngine::IsPlaying(void)
+{
+	GetTime(); // Notices the end
+	return Playing;
+}
+
+OptionalT<MediaTimeT> NullEngine::GetTime(void)
+{
+	if (!Playing) return MediaTimeT(Base);
+	auto const Time = Base + static_cast<uint64_t>((Clock() - StartedAt) * Rate * (1.0f + Skew));
+	if ((*Duration == 0) || (Time < *Duration)) return MediaTimeT(Time);
+
+	// There are no events on the virtual clock, so the end is found when the time is next read
+	Base = *Duration;
+	Playing = false;
+	CallTransfer([this](void) { if (EndCallback) EndCallback(); });
+	return Duration;
+}
+
+void NullEngine::Seek(MediaTimeT Position)
+{
+	Base = *Position;
+	StartedAt = Clock();
+}
+
+void NullEngine::SetRate(float Rate)
+{
+	Base = **GetTime();
+	StartedAt = Clock();
+	this->Rate = Rate;
+}
+
+void NullEngine::SetVolume(float Volume) {}
+
+void NullEngine::Start(MediaTimeT Position)
+{
+	Playing = true;
+	Base = *Position;
+	StartedAt = Clock();
+}
@@ -0,0 +1,192 @@
+#ifndef engine_h
+#define engine_h
+
+#include "shared.h"
+#include "core.h"
+
+#include <vlc/vlc.h>
+#include <array>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+
+enum struct EngineType { VLC, Null };
+
+// A file that's still being received.  Reads past the received part wait for more to arrive.
+struct GrowingFile
+{
+	GrowingFile(PathT const &Path, uint64_t Size);
+
+	// Any thread
+	void SetAvailable(uint64_t Available);
+	void Cancel(void); // Fails all reads from now on
+	void Interrupt(void); // Fails reads waiting now, so whatever's reading can stop without waiting out the timeout
+
+	PathT const &GetPath(void) const;
+	uint64_t GetSize(void) const;
+
+	// Waits for data at Offset.  Returns how many bytes can be read, 0 at the end, or nothing if it was cancelled,
+	// interrupted or nothing arrived for too long.
+	OptionalT<uint64_t> WaitFor(uint64_t Offset);
+
+	private:
+		PathT const Path;
+		uint64_t const Size;
+		std::mutex Mutex;
+		std::condition_variable Changed;
+		uint64_t Available;
+		bool Cancelled;
+		uint64_t Interrupts;
+};
+
+// Plays one media item at a time.  Methods are core thread only, and callbacks are called in the core thread.
+struct AudioEngine
+{
+	struct Media
+	{
+		virtual ~Media(void);
+	};
+
+	virtual ~AudioEngine(void);
+
+	std::function<void(void)> EndCallback;
+	std::function<void(void)> PrerolledCallback; // After Preroll, once the media is held at the position
+
+	// Returns null on failure; see GetError
+	virtual std::unique_ptr<Media> Open(PathT const &Filename) = 0;
+	virtual std::unique_ptr<Media> OpenGrowing(std::shared_ptr<GrowingFile> const &File) = 0;
+	virtual std::string GetError(void) const = 0;
+	virtual MediaTimeT GetDuration(Media &Item) = 0; // 0 if not known yet
+
+	// Start now
+	virtual void Play(Media &Item, MediaTimeT Position) = 0;
+
+	// Open and seek silently, then hold until Release.  Whatever's currently playing keeps playing until then, so
+	// this can preload the next item.  If it's not ready by the release it starts from Position.
+	virtual void Preroll(Media &Item, MediaTimeT Position) = 0;
+	virtual void Release(MediaTimeT Position) = 0;
+
+	virtual void Pause(void) = 0;
+	virtual bool IsPlaying(void) = 0;
+	virtual OptionalT<MediaTimeT> GetTime(void) = 0;
+	virtual void Seek(MediaTimeT Position) = 0;
+	virtual void SetRate(float Rate) = 0;
+	virtual void SetVolume(float Volume) = 0;
+};
+
+std::unique_ptr<AudioEngine> CreateEngine(EngineType Type, CallTransferType &CallTransfer);
+
+struct VLCEngine : AudioEngine
+{
+	VLCEngine(CallTransferType &CallTransfer);
+	~VLCEngine(void);
+
+	std::unique_ptr<Media> Open(PathT const &Filename) override;
+	std::unique_ptr<Media> OpenGrowing(std::shared_ptr<GrowingFile> const &File) override;
+	std::string GetError(void) const override;
+	MediaTimeT GetDuration(Media &Item) override;
+	void Play(Media &Item, MediaTimeT Position) override;
+	void Preroll(Media &Item, MediaTimeT Position) override;
+	void Release(MediaTimeT Position) override;
+	void Pause(void) override;
+	bool IsPlaying(void) override;
+	OptionalT<MediaTimeT> GetTime(void) override;
+	void Seek(MediaTimeT Position) override;
+	void SetRate(float Rate) override;
+	void SetVolume(float Volume) override;
+
+	private:
+		struct VLCMedia : Media
+		{
+			libvlc_media_t *Media = nullptr;
+			std::shared_ptr<GrowingFile> File; // Read through callbacks if set
+			VLCMedia(libvlc_media_t *Media);
+			VLCMedia(void);
+			~VLCMedia(void);
+		};
+
+		static int GrowingOpen(void *Opaque, void **Data, uint64_t *Size);
+		static ssize_t GrowingRead(void *Data, unsigned char *Buffer, size_t Length);
+		static int GrowingSeek(void *Data, uint64_t Offset);
+		static void GrowingClose(void *Data);
+		static void GrowingFreed(libvlc_event_t const *Event, void *UserData);
+
+		// Two players, so the next item can be prerolled while the current one plays
+		struct PlayerSlot
+		{
+			VLCEngine *Engine;
+			libvlc_media_player_t *Player;
+			std::shared_ptr<GrowingFile> File; // Of the media set on the player, if it's read through callbacks
+		};
+
+		libvlc_media_player_t *Current(void);
+		libvlc_media_player_t *Spare(void);
+		void SetMedia(PlayerSlot &Slot, VLCMedia &Item);
+		void Stop(PlayerSlot &Slot);
+		void StopSpare(void); // If it was playing the item before a release
+		void CancelPreroll(void);
+
+		static void VLCMediaEndCallback(libvlc_event_t const *Event, void *UserData);
+		static void VLCMediaPlayingCallback(libvlc_event_t const *Event, void *UserData);
+
+		CallTransferType &CallTransfer; // libVLC can't be called back into from its own event thread
+
+		libvlc_instance_t *VLC;
+		std::array<PlayerSlot, 2> Players;
+		size_t CurrentIndex;
+		bool StopPending;
+
+		struct
+		{
+			bool Active;
+			bool Ready;
+			MediaTimeT Position;
+		} Prerolling;
+};
+
+// Plays nothing, against a virtual clock.  Deterministic, for measuring the sync code without a sound device.  Like
+// VLCEngine, callbacks are transferred rather than called from inside the methods.
+struct NullEngine : AudioEngine
+{
+	NullEngine(CallTransferType &CallTransfer);
+
+	// Defaults to GetNow, can be replaced with a simulated clock
+	std::function<uint64_t(void)> Clock;
+	// Playback speed error relative to the clock, like a sound card running slightly off
+	float Skew;
+	// Of all media, 0 for unknown.  Playback ends there.
+	MediaTimeT Duration;
+
+	std::unique_ptr<Media> Open(PathT const &Filename) override;
+	std::unique_ptr<Media> OpenGrowing(std::shared_ptr<GrowingFile> const &File) override;
+	std::string GetError(void) const override;
+	MediaTimeT GetDuration(Media &Item) override;
+	void Play(Media &Item, MediaTimeT Position) override;
+	void Preroll(Media &Item, MediaTimeT Position) override;
+	void Release(MediaTimeT Position) override;
+	void Pause(void) override;
+	bool IsPlaying(void) override;
+	OptionalT<MediaTimeT> GetTime(void) override;
+	void Seek(MediaTimeT Position) override;
+	void SetRate(float Rate) override;
+	void SetVolume(float Volume) override;
+
+	private:
+		void Start(MediaTimeT Position);
+
+		CallTransferType &CallTransfer;
+
+		bool Playing;
+		uint64_t Base; // Position in ms when StartedAt was set
+		uint64_t StartedAt;
+		float Rate;
+
+		struct
+		{
+			bool Active;
+			MediaTimeT Position;
+		} Prerolling;
+};
+
+#endif
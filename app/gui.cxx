@@ -13,6 +13,7 @@
 #include <QLineEdit>
 #include <QTreeView>
 #include <QAbstractItemModel>
+#include <QSortFilterProxyModel>
 #include <QTreeWidget>
 #include <QTreeWidgetItem>
 #include <QMenu>
@@ -25,6 +26,7 @@
 #include <QAction>
 #include <QTimer>
 #include <QDir>
+#include <QFileInfo>
 #include <QFileDialog>
 #include <QCryptographicHash>
 #include <QStyledItemDelegate>
@@ -443,9 +445,42 @@ struct GUIPlaylistType : PlaylistType, QAbstractItemModel
 {
 	private:
 		std::vector<PlaylistColumns> Columns;
+		std::string Filter;
+		std::unordered_set<HashT, HashHashT> Filtered; // Items matching Filter, kept up to date as items change
+
+		// Converted on first paint and dropped when the item changes, so scrolling doesn't convert every cell again
+		struct DisplayText
+		{
+			QString Track;
+			QString Artist;
+			QString Album;
+			QString Title;
+		};
+		mutable std::unordered_map<HashT, DisplayText, HashHashT> DisplayCache;
+		QString const PauseText;
+		QString const PlayText;
+
+		DisplayText const &GetDisplay(PlaylistInfo const &Item) const
+		{
+			auto Found = DisplayCache.find(Item.Hash);
+			if (Found != DisplayCache.end()) return Found->second;
+			auto &Out = DisplayCache[Item.Hash];
+			if (Item.Track) Out.Track = QString::number(*Item.Track);
+			Out.Artist = QString::fromUtf8(Item.Artist.c_str());
+			Out.Album = QString::fromUtf8(Item.Album.c_str());
+			Out.Title = QString::fromUtf8(Item.Title.c_str());
+			return Out;
+		}
+
+		void Refilter(HashT const &Hash)
+		{
+			if (Filter.empty()) return;
+			if (Searchable.Matches(Hash, Filter)) Filtered.insert(Hash);
+			else Filtered.erase(Hash);
+		}
 	public:
 
-	GUIPlaylistType(void)
+	GUIPlaylistType(void) : PauseText{QString::fromUtf8(Local("=").c_str())}, PlayText{QString::fromUtf8(Local(">").c_str())}
 	{
 		int const ColumnRows = Settings->beginReadArray(SCColumns);
 		if (ColumnRows == 0)
@@ -480,21 +515,50 @@ struct GUIPlaylistType : PlaylistType, QAbstractItemModel
 		Settings->endArray();
 	}
 
-	void AddUpdate(MediaInfo const &Item)
+	void AddUpdate(std::vector<MediaInfo> const &Items)
 	{
-		auto Found = Find(Item.Hash);
-		if (!Found)
+		// One signal per batch; relayouting per item stalls the view while a library arrives
+		std::vector<MediaInfo const *> New;
+		OptionalT<size_t> FirstChanged, LastChanged;
+		for (auto const &Item : Items)
 		{
-			beginInsertRows(QModelIndex(), Playlist.size() - 1, Playlist.size() - 1);
+			auto Found = Find(Item.Hash);
+			if (!Found)
+			{
+				New.push_back(&Item);
+				continue;
+			}
 			PlaylistType::AddUpdate(Item);
-			endInsertRows();
-			if (SignalUnsorted) SignalUnsorted();
+			Refilter(Item.Hash);
+			DisplayCache.erase(Item.Hash);
+			if (!FirstChanged || (*Found < *FirstChanged)) FirstChanged = *Found;
+			if (!LastChanged || (*Found > *LastChanged)) LastChanged = *Found;
 		}
-		else
+		if (FirstChanged) dataChanged(createIndex(*FirstChanged, 0), createIndex(*LastChanged, columnCount()));
+		if (!New.empty())
 		{
-			PlaylistType::AddUpdate(Item);
-			dataChanged(createIndex(*Found, 0), createIndex(*Found, columnCount()));
+			// Starting from nothing, a reset is cheaper for the view than an insert
+			bool const Reset = Playlist.empty();
+			if (Reset) beginResetModel();
+			else beginInsertRows(QModelIndex(), Playlist.size(), Playlist.size() + New.size() - 1);
+			Playlist.reserve(Playlist.size() + New.size());
+			for (auto Item : New)
+			{
+				PlaylistType::AddUpdate(*Item);
+				Refilter(Item->Hash);
+			}
+			if (Reset) endResetModel();
+			else endInsertRows();
+		}
+		// New items and remote moves go to their place in the shared order, unless sorted locally
+		bool const Moved = !LocalOrder && !IsPositionSorted();
+		if (Moved)
+		{
+			layoutAboutToBeChanged({}, QAbstractItemModel::VerticalSortHint);
+			SortByPosition();
+			layoutChanged({}, QAbstractItemModel::VerticalSortHint);
 		}
+		if ((!New.empty() || Moved) && SignalUnsorted) SignalUnsorted();
 	}
 
 	void Remove(HashT const &Hash)
@@ -503,9 +567,26 @@ struct GUIPlaylistType : PlaylistType, QAbstractItemModel
 		if (!Found) return;
 		beginRemoveRows(QModelIndex(), *Found, *Found);
 		PlaylistType::Remove(Hash);
+		Filtered.erase(Hash);
+		DisplayCache.erase(Hash);
 		endRemoveRows();
 	}
 
+	void SetFilter(std::string const &Query)
+	{
+		Filter = Query;
+		Filtered.clear();
+		if (Filter.empty()) return;
+		for (auto const &Hash : Searchable.Find(Filter)) Filtered.insert(Hash);
+	}
+
+	bool Accepts(int Row) const
+	{
+		if (Filter.empty()) return true;
+		if ((Row < 0) || (static_cast<size_t>(Row) >= Playlist.size())) return false;
+		return Filtered.count(Playlist[Row].Hash);
+	}
+
 	bool Select(HashT const &Hash)
 	{
 		if (Index) dataChanged(createIndex(*Index, 1), createIndex(*Index, 1));
@@ -543,6 +624,14 @@ struct GUIPlaylistType : PlaylistType, QAbstractItemModel
 		layoutChanged({}, QAbstractItemModel::VerticalSortHint);
 	}
 
+	void UnshareOrder(void)
+	{
+		layoutAboutToBeChanged({}, QAbstractItemModel::VerticalSortHint);
+		PlaylistType::UnshareOrder();
+		layoutChanged({}, QAbstractItemModel::VerticalSortHint);
+		if (SignalUnsorted) SignalUnsorted();
+	}
+
 	QModelIndex index(int Row, int Column, QModelIndex const &Parent) const override { return createIndex(Row, Column); }
 	QModelIndex parent(QModelIndex const &Index) const override { return QModelIndex(); }
 	int rowCount(const QModelIndex &Parent) const override
@@ -590,21 +679,21 @@ struct GUIPlaylistType : PlaylistType, QAbstractItemModel
 				if (Index.column() == 0)
 					switch (Playlist[Index.row()].State)
 					{
-						case PlayState::Pause: return QString(Local("=").c_str());
-						case PlayState::Play: return QString(Local(">").c_str());
+						case PlayState::Pause: return PauseText;
+						case PlayState::Play: return PlayText;
 						default: return QVariant();
 					}
 				switch (Columns[Index.column() - 1])
 				{
 					case PlaylistColumns::Track:
 					{
-						auto &Track = Playlist[Index.row()].Track;
-						if (!Track) return QVariant();
-						return QString::fromUtf8((StringT() << *Track).str().c_str());
+						auto const &Track = GetDisplay(Playlist[Index.row()]).Track;
+						if (Track.isEmpty()) return QVariant();
+						return Track;
 					}
-					case PlaylistColumns::Artist: return QString::fromUtf8(Playlist[Index.row()].Artist.c_str());
-					case PlaylistColumns::Album: return QString::fromUtf8(Playlist[Index.row()].Album.c_str());
-					case PlaylistColumns::Title: return QString::fromUtf8(Playlist[Index.row()].Title.c_str());
+					case PlaylistColumns::Artist: return GetDisplay(Playlist[Index.row()]).Artist;
+					case PlaylistColumns::Album: return GetDisplay(Playlist[Index.row()]).Album;
+					case PlaylistColumns::Title: return GetDisplay(Playlist[Index.row()]).Title;
 					default: assert(false); return QVariant();
 				}
 			default:
@@ -628,43 +717,11 @@ struct GUIPlaylistType : PlaylistType, QAbstractItemModel
 
 	void sort(int Column, Qt::SortOrder Order) override
 	{
-		HashT CurrentID;
-		if (Index)
-		{
-			assert(*Index < Playlist.size());
-			CurrentID = Playlist[*Index].Hash;
-		}
 		if (Column < 0) return;
 		if (Column == 0) return;
 		if (Column >= columnCount({}) + 1) return;
 		layoutAboutToBeChanged({}, QAbstractItemModel::VerticalSortHint);
-		switch (Columns[Column - 1])
-		{
-			case PlaylistColumns::Track:
-				std::sort(Playlist.begin(), Playlist.end(), [](PlaylistInfo const &Left, PlaylistInfo const &Right)
-					{ return Left.Track < Right.Track; });
-				break;
-			case PlaylistColumns::Artist:
-				std::sort(Playlist.begin(), Playlist.end(), [](PlaylistInfo const &Left, PlaylistInfo const &Right)
-					{ return Left.Artist < Right.Artist; });
-				break;
-			case PlaylistColumns::Album:
-				std::sort(Playlist.begin(), Playlist.end(), [](PlaylistInfo const &Left, PlaylistInfo const &Right)
-					{ return Left.Album < Right.Album; });
-				break;
-			case PlaylistColumns::Title:
-				std::sort(Playlist.begin(), Playlist.end(), [](PlaylistInfo const &Left, PlaylistInfo const &Right)
-					{ return Left.Title < Right.Title; });
-				break;
-			default: assert(false); break;
-		}
-		if (Order == Qt::DescendingOrder)
-			std::reverse(Playlist.begin(), Playlist.end());
-		if (Index)
-		{
-			auto Found = Find(CurrentID);
-			if (Found) Index = *Found;
-		}
+		PlaylistType::Sort({SortFactor(Columns[Column - 1], Order == Qt::DescendingOrder)});
 		layoutChanged({}, QAbstractItemModel::VerticalSortHint);
 	}
 
@@ -711,27 +768,37 @@ struct GUIPlaylistType : PlaylistType, QAbstractItemModel
 		}
 		if (Moves.empty()) return true;
 
-		std::vector<PlaylistInfo> New;
-		New.reserve(Playlist.size());
-
-		for (int Index = 0; Index < Playlist.size(); ++Index)
+		// Move each contiguous run of rows in place.  Runs above the drop point go in bottom up and runs below it top
+		// down, so they land in their original order.
+		size_t const To = ((ToIndex < 0) || (ToIndex > Playlist.size())) ? Playlist.size() : ToIndex;
+		std::sort(Moves.begin(), Moves.end());
+		Moves.erase(std::unique(Moves.begin(), Moves.end()), Moves.end());
+		struct Run { size_t First; size_t Count; };
+		std::vector<Run> Above, Below;
+		for (auto const Row : Moves)
 		{
-			if (Index == ToIndex)
-				for (auto const &Move : Moves)
-					New.push_back(Playlist[Move]);
-			bool Skip = false;
-			for (auto const &Move : Moves) if (Index == Move) { Skip = true; break; }
-			if (Skip) continue;
-			New.push_back(Playlist[Index]);
+			auto &Runs = (Row < To) ? Above : Below;
+			if (!Runs.empty() && (Runs.back().First + Runs.back().Count == Row)) ++Runs.back().Count;
+			else Runs.push_back({static_cast<size_t>(Row), 1});
+		}
+		auto const MoveRun = [this](Run const &Moving, size_t Destination)
+		{
+			if (!beginMoveRows(QModelIndex(), Moving.First, Moving.First + Moving.Count - 1, QModelIndex(), Destination)) return;
+			PlaylistType::Move(Moving.First, Moving.Count, Destination);
+			endMoveRows();
+		};
+		size_t Destination = To;
+		for (auto Moving = Above.rbegin(); Moving != Above.rend(); ++Moving)
+		{
+			MoveRun(*Moving, Destination);
+			Destination -= Moving->Count;
+		}
+		Destination = To;
+		for (auto const &Moving : Below)
+		{
+			MoveRun(Moving, Destination);
+			Destination += Moving.Count;
 		}
-		if ((ToIndex == -1) || (ToIndex == Playlist.size()))
-			for (auto const &Move : Moves)
-				New.push_back(Playlist[Move]);
-
-		AssertE(New.size(), Playlist.size());
-		layoutAboutToBeChanged({}, QAbstractItemModel::VerticalSortHint);
-		Playlist.swap(New);
-		layoutChanged({}, QAbstractItemModel::VerticalSortHint);
 
 		if (SignalUnsorted) SignalUnsorted();
 
@@ -739,6 +806,28 @@ struct GUIPlaylistType : PlaylistType, QAbstractItemModel
 	}
 };
 
+// Hides playlist rows that don't match the search.  Rows stay in playlist order; sorting is passed through to the
+// playlist itself.
+struct PlaylistFilterType : QSortFilterProxyModel
+{
+	PlaylistFilterType(GUIPlaylistType *Source, QObject *Parent) : QSortFilterProxyModel(Parent), Source(Source)
+		{ setSourceModel(Source); }
+
+	void SetFilter(std::string const &Query)
+	{
+		Source->SetFilter(Query);
+		invalidateFilter();
+	}
+
+	void sort(int Column, Qt::SortOrder Order) override { Source->sort(Column, Order); }
+
+	protected:
+		bool filterAcceptsRow(int Row, QModelIndex const &Parent) const override { return Source->Accepts(Row); }
+
+	private:
+		GUIPlaylistType *Source;
+};
+
 void OpenPlayer(std::string const &InitialHandle, std::string const &Host, uint16_t Port)
 {
 	try
@@ -810,13 +899,20 @@ void OpenPlayer(std::string const &InitialHandle, std::string const &Host, uint1
 		auto RightWidget = new QWidget();
 		auto RightLayout = new QBoxLayout(QBoxLayout::TopToBottom);
 		RightLayout->setMargin(0);
+		auto PlaylistSearch = new QLineEdit();
+		PlaylistSearch->setPlaceholderText(Local("Search").c_str());
+		PlaylistSearch->setClearButtonEnabled(true);
+		RightLayout->addWidget(PlaylistSearch);
+		auto PlaylistFilter = new PlaylistFilterType(Playlist, MainWindow);
 		auto PlaylistView = new QTreeView();
 		PlaylistView->setSortingEnabled(true);
-		PlaylistView->setModel(Playlist);
+		PlaylistView->setModel(PlaylistFilter);
 		auto ConfigureColumns = new QAction(Local("Select columns...").c_str(), MainWindow);
 		PlaylistView->header()->addAction(ConfigureColumns);
 		PlaylistView->header()->setContextMenuPolicy(Qt::ActionsContextMenu);
-		PlaylistView->header()->setSectionResizeMode(QHeaderView::ResizeToContents);
+		PlaylistView->setUniformRowHeights(true);
+		PlaylistView->header()->setSectionResizeMode(QHeaderView::Interactive);
+		PlaylistView->header()->setResizeContentsPrecision(0); // Only measure rows on screen
 		PlaylistView->header()->setStretchLastSection(true);
 		PlaylistView->setDragEnabled(true);
 		PlaylistView->setAcceptDrops(true);
@@ -849,6 +945,16 @@ void OpenPlayer(std::string const &InitialHandle, std::string const &Host, uint1
 		OrderMenu->addAction(Shuffle);
 		auto AdvancedOrder = new QAction(Local("Advanced...").c_str(), MainWindow);
 		OrderMenu->addAction(AdvancedOrder);
+		OrderMenu->addSeparator();
+		auto ShareOrder = new QAction(Local("Share this order").c_str(), MainWindow);
+		OrderMenu->addAction(ShareOrder);
+		auto UnshareOrder = new QAction(Local("Back to shared order").c_str(), MainWindow);
+		OrderMenu->addAction(UnshareOrder);
+		QObject::connect(OrderMenu, &QMenu::aboutToShow, [=](void)
+		{
+			ShareOrder->setEnabled(Playlist->HasLocalOrder());
+			UnshareOrder->setEnabled(Playlist->HasLocalOrder());
+		});
 		PlaylistControls->addAction(OrderMenu->menuAction());
 		PlaylistControls->addSeparator();
 		auto Previous = new QAction(Local("Previous").c_str(), MainWindow);
@@ -955,6 +1061,20 @@ void OpenPlayer(std::string const &InitialHandle, std::string const &Host, uint1
 		};
 
 		// Behavior
+		// Fit the columns once things settle down rather than measuring on every change like ResizeToContents does
+		auto FitColumnsTimer = new QTimer(PlaylistView);
+		FitColumnsTimer->setSingleShot(true);
+		QObject::connect(FitColumnsTimer, &QTimer::timeout, [=](void)
+		{
+			for (int Column = 0; Column + 1 < PlaylistFilter->columnCount(); ++Column)
+				PlaylistView->resizeColumnToContents(Column);
+		});
+		auto FitColumns = [=](void) { FitColumnsTimer->start(250); };
+		QObject::connect(PlaylistFilter, &QAbstractItemModel::modelReset, FitColumns);
+		QObject::connect(PlaylistFilter, &QAbstractItemModel::rowsInserted, FitColumns);
+		QObject::connect(PlaylistFilter, &QAbstractItemModel::columnsInserted, FitColumns);
+		QObject::connect(PlaylistFilter, &QAbstractItemModel::layoutChanged, FitColumns);
+
 		Playlist->SignalUnsorted = [PlaylistView](void)
 			{ PlaylistView->sortByColumn(-1, Qt::AscendingOrder); };
 
@@ -972,15 +1092,16 @@ void OpenPlayer(std::string const &InitialHandle, std::string const &Host, uint1
 		};
 		Core->SeekCallback = [=](float Percent, float Duration) { CrossThread->Transfer([=](void)
 			{ if (!Position->isSliderDown()) Position->setValue(static_cast<int>(Percent * 10000)); }); };
-		Core->AddCallback = [=](MediaInfo Item) { CrossThread->Transfer([=](void) { Playlist->AddUpdate(Item); }); };
+		Playlist->ReorderCallback = [=](std::vector<OrderPosition> const &Positions) { Core->Reorder(Positions); };
+		Core->AddUpdateCallback = [=](std::vector<MediaInfo> Items) { CrossThread->Transfer([=](void) { Playlist->AddUpdate(Items); }); };
 		Core->RemoveCallback = [=](HashT const &MediaID) { CrossThread->Transfer([=](void) { Playlist->Remove(MediaID); }); };
-		Core->UpdateCallback = [=](MediaInfo Item) { CrossThread->Transfer([=](void) { Playlist->AddUpdate(Item); }); };
 		Core->SelectCallback = [=](HashT const &MediaID)
 		{
 			CrossThread->Transfer([=](void)
 			{
 				Volition->Ack();
 				bool WasSame = Playlist->Select(MediaID);
+				Core->Prioritize(Playlist->GetUpcomingIDs(3));
 				auto Playing = Playlist->GetCurrent();
 				Assert(Playing);
 				if (!WasSame)
@@ -1010,6 +1131,17 @@ void OpenPlayer(std::string const &InitialHandle, std::string const &Host, uint1
 				Core->Play(*NextID, 0ul);
 			});
 		};
+		Core->EndingCallback = [=](void)
+		{
+			CrossThread->Transfer([=](void)
+			{
+				if (!Volition->InControl()) return;
+				auto NextID = Playlist->GetNextID();
+				if (!NextID) return;
+				Volition->Request();
+				Core->PlayNext(*NextID);
+			});
+		};
 
 		QObject::connect(Splitter, &QSplitter::splitterMoved, [=](int, int)
 		{
@@ -1184,9 +1316,12 @@ void OpenPlayer(std::string const &InitialHandle, std::string const &Host, uint1
 			Dialog->show();
 		});
 
+		QObject::connect(PlaylistSearch, &QLineEdit::textChanged, [=](QString const &Text)
+			{ PlaylistFilter->SetFilter(Text.toUtf8().constData()); });
+
 		QObject::connect(PlaylistView, &QAbstractItemView::doubleClicked, [=](QModelIndex const &Index)
 		{
-			auto ID = Playlist->GetID(Index.row());
+			auto ID = Playlist->GetID(PlaylistFilter->mapToSource(Index).row());
 			if (!ID) return;
 			Volition->Request();
 			Core->Play(*ID, 0ul);
@@ -1227,6 +1362,12 @@ void OpenPlayer(std::string const &InitialHandle, std::string const &Host, uint1
 		QObject::connect(Shuffle, &QAction::triggered, [=](bool)
 			{ Playlist->Shuffle(); });
 
+		QObject::connect(ShareOrder, &QAction::triggered, [=](bool)
+			{ Playlist->ShareOrder(); });
+
+		QObject::connect(UnshareOrder, &QAction::triggered, [=](bool)
+			{ Playlist->UnshareOrder(); });
+
 		QObject::connect(AdvancedOrder, &QAction::triggered, [=](bool)
 		{
 			auto Dialog = new QDialog{MainWindow};
@@ -1382,6 +1523,10 @@ void OpenPlayer(std::string const &InitialHandle, std::string const &Host, uint1
 
 		MainWindow->show();
 
+		// Saved beside the settings
+		auto const SnapshotDirectory = QFileInfo(Settings->fileName()).absolutePath();
+		QDir().mkpath(SnapshotDirectory);
+		Core->Restore(PathT::Qualify((SnapshotDirectory + "/library").toUtf8().data()));
 		Core->Open(Host == "0.0.0.0" ? true : false, Host, Port);
 	}
 	catch (ConstructionErrorT const &Error)
@@ -1,6 +1,7 @@
 #include "hash.h"
 
 #include <iomanip>
+#include <cstring>
 
 extern "C"
 {
@@ -15,6 +16,14 @@ std::string FormatHash(HashT const &Hash)
 	return Display.str();
 }
 
+size_t HashHashT::operator()(HashT const &Hash) const
+{
+	size_t Out;
+	static_assert(sizeof(Out) <= std::tuple_size<HashT>::value, "Hash is shorter than size_t");
+	std::memcpy(&Out, Hash.data(), sizeof(Out));
+	return Out;
+}
+
 OptionalT<HashT> UnformatHash(char const *String)
 {
 	HashT Hash;
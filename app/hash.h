@@ -11,6 +11,9 @@ typedef std::array<uint8_t, 16> HashT;
 
 std::string FormatHash(HashT const &Hash);
 
+// For unordered containers; hashes are already uniformly distributed so this just takes the leading bytes
+struct HashHashT { size_t operator()(HashT const &Hash) const; };
+
 OptionalT<HashT> UnformatHash(char const *String);
 
 OptionalT<std::pair<HashT, size_t>> HashFile(PathT const &Path);
@@ -1,4 +1,7 @@
+#include "network.h"
+
 #include <csignal>
+#include <algorithm>
 
 #if !defined(WINDOWS)
 static struct IgnoreSIGPIPEStatic
@@ -6,3 +9,156 @@ static struct IgnoreSIGPIPEStatic
 	IgnoreSIGPIPEStatic(void) { std::signal(SIGPIPE, SIG_IGN); }
 } IgnoreSIGPIPE;
 #endif
+
+constexpr uint32_t TimerWheel::None;
+
+TimerWheel::TimerWheel(uint64_t Now) : Current{Now}, Active{0}, FreeNodes{None}
+{
+	Lists.fill(None);
+}
+
+TimerWheel::HandleT TimerWheel::Add(uint64_t Now, uint64_t Delay, CallT &&Callback)
+{
+	auto Index = FreeNodes;
+	if (Index == None)
+	{
+		Index = static_cast<uint32_t>(Nodes.size());
+		Nodes.push_back(NodeT{0, None, None, None, 1, CallT{}}); // Generation starts at 1 so a zeroed handle matches nothing
+	}
+	else FreeNodes = Nodes[Index].Next;
+	auto &Node = Nodes[Index];
+	auto const MaxDelta = (uint64_t{1} << (SlotBits * Levels)) - 1;
+	Node.Due = std::min(std::max(Now + std::min(Delay, MaxDelta), Current), Current + MaxDelta);
+	Node.Callback = std::move(Callback);
+	Place(Index);
+	++Active;
+	return {Index, Node.Generation};
+}
+
+bool TimerWheel::Cancel(HandleT const &Handle)
+{
+	if (!Pending(Handle)) return false;
+	Free(Handle.Index);
+	return true;
+}
+
+bool TimerWheel::Pending(HandleT const &Handle) const
+{
+	if (Handle.Index >= Nodes.size()) return false;
+	auto const &Node = Nodes[Handle.Index];
+	return (Node.List != None) && (Node.Generation == Handle.Generation);
+}
+
+void TimerWheel::Advance(uint64_t Now)
+{
+	while (Current <= Now)
+	{
+		if (!Active)
+		{
+			Current = Now + 1;
+			return;
+		}
+		auto const Slot = static_cast<uint32_t>(Current & (Slots - 1));
+		if ((Slot != 0) && (Lists[Slot] == None))
+		{
+			// Nothing fires or moves down until the next due tick, so don't step through the gap
+			Current = std::min(NextDue(), Now + 1);
+			continue;
+		}
+		if ((Slot == 0) && (Cascade(1) == 0) && (Cascade(2) == 0)) Cascade(3);
+		// Moved aside so callbacks adding timers at the next tick don't land in the list being fired
+		while (Lists[Slot] != None)
+		{
+			auto const Index = Lists[Slot];
+			Unlink(Index);
+			Link(Index, FiringList);
+		}
+		++Current;
+		while (Lists[FiringList] != None)
+		{
+			auto const Index = Lists[FiringList];
+			auto Callback = std::move(Nodes[Index].Callback);
+			Free(Index);
+			Callback();
+		}
+	}
+}
+
+uint64_t TimerWheel::NextDue(void) const
+{
+	Assert(Active);
+	// The bottom level holds timers at their due tick.  Timers on higher levels come down when the level below
+	// wraps around to their slot, or at Current if that wrap hasn't been processed yet.
+	auto Out = std::numeric_limits<uint64_t>::max();
+	for (unsigned int Level = 0; Level < Levels; ++Level)
+	{
+		auto const Shift = SlotBits * Level;
+		auto const Aligned = (Current & ((uint64_t{1} << Shift) - 1)) == 0;
+		uint64_t const First = ((Level == 0) || Aligned) ? 0 : 1;
+		uint64_t const Last = (Level == 0) ? Slots - 1 : Slots;
+		for (auto Offset = First; Offset <= Last; ++Offset)
+		{
+			auto const Block = (Current >> Shift) + Offset;
+			auto const Tick = Block << Shift;
+			if (Tick >= Out) break;
+			if (Lists[Level * Slots + (Block & (Slots - 1))] == None) continue;
+			Out = Tick;
+			break;
+		}
+	}
+	return Out;
+}
+
+size_t TimerWheel::Count(void) const { return Active; }
+
+void TimerWheel::Place(uint32_t Index)
+{
+	auto const Due = Nodes[Index].Due;
+	auto const Delta = Due - Current;
+	unsigned int Level = 0;
+	while ((Level + 1 < Levels) && (Delta >> (SlotBits * (Level + 1)))) ++Level;
+	Link(Index, Level * Slots + static_cast<uint32_t>((Due >> (SlotBits * Level)) & (Slots - 1)));
+}
+
+void TimerWheel::Link(uint32_t Index, uint32_t List)
+{
+	auto &Node = Nodes[Index];
+	Node.List = List;
+	Node.Previous = None;
+	Node.Next = Lists[List];
+	if (Node.Next != None) Nodes[Node.Next].Previous = Index;
+	Lists[List] = Index;
+}
+
+void TimerWheel::Unlink(uint32_t Index)
+{
+	auto &Node = Nodes[Index];
+	if (Node.Previous != None) Nodes[Node.Previous].Next = Node.Next;
+	else Lists[Node.List] = Node.Next;
+	if (Node.Next != None) Nodes[Node.Next].Previous = Node.Previous;
+	Node.List = None;
+}
+
+void TimerWheel::Free(uint32_t Index)
+{
+	Unlink(Index);
+	auto &Node = Nodes[Index];
+	Node.Callback = CallT{};
+	++Node.Generation;
+	Node.Next = FreeNodes;
+	FreeNodes = Index;
+	--Active;
+}
+
+uint32_t TimerWheel::Cascade(unsigned int Level)
+{
+	auto const Slot = static_cast<uint32_t>((Current >> (SlotBits * Level)) & (Slots - 1));
+	auto const List = Level * Slots + Slot;
+	while (Lists[List] != None)
+	{
+		auto const Index = Lists[List];
+		Unlink(Index);
+		Place(Index);
+	}
+	return Slot;
+}
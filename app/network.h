@@ -2,6 +2,7 @@
 #define network_h
 
 #include "shared.h"
+#include "protocol.h"
 #include "../ren-cxx-basics/type.h"
 #include "translation/translation.h"
 
@@ -13,8 +14,66 @@ extern "C"
 #include <mutex>
 #include <condition_variable>
 #include <thread>
-#include <queue>
 #include <list>
+#include <vector>
+#include <array>
+#include <limits>
+#include <algorithm>
+
+// Hierarchical timer wheel with 1ms ticks: four levels of 256 slots, with a timer moving down a level whenever the
+// wheel below it wraps.  Adding, cancelling and firing are constant time.  Not thread safe.
+struct TimerWheel
+{
+	// A zeroed handle matches no timer
+	struct HandleT
+	{
+		uint32_t Index;
+		uint32_t Generation;
+	};
+
+	TimerWheel(uint64_t Now);
+
+	// Times in ms.  Delays of more than about 49 days are shortened to that.
+	HandleT Add(uint64_t Now, uint64_t Delay, CallT &&Callback);
+	// Returns false if the timer already fired or was cancelled
+	bool Cancel(HandleT const &Handle);
+	// Whether the timer is still waiting to fire
+	bool Pending(HandleT const &Handle) const;
+	// Calls everything due by Now, in due order.  Callbacks may add and cancel timers.
+	void Advance(uint64_t Now);
+	// When Advance next has something to do, either fire timers or move them down a level.  Only valid with timers.
+	uint64_t NextDue(void) const;
+	size_t Count(void) const;
+
+	private:
+		static constexpr unsigned int SlotBits = 8;
+		static constexpr uint32_t Slots = 1u << SlotBits;
+		static constexpr unsigned int Levels = 4;
+		static constexpr uint32_t FiringList = Levels * Slots;
+		static constexpr uint32_t None = ~uint32_t{0};
+
+		struct NodeT
+		{
+			uint64_t Due;
+			uint32_t Previous;
+			uint32_t Next; // Also links the free list
+			uint32_t List; // None when free
+			uint32_t Generation;
+			CallT Callback;
+		};
+
+		void Place(uint32_t Index);
+		void Link(uint32_t Index, uint32_t List);
+		void Unlink(uint32_t Index);
+		void Free(uint32_t Index);
+		uint32_t Cascade(unsigned int Level);
+
+		uint64_t Current; // Next tick to process
+		size_t Active;
+		std::vector<NodeT> Nodes;
+		uint32_t FreeNodes;
+		std::array<uint32_t, Levels * Slots + 1> Lists; // Last one holds the timers being fired
+};
 
 template <typename ConnectionType> struct Network
 {
@@ -44,7 +103,7 @@ template <typename ConnectionType> struct Network
 	struct Connection
 	{
 		Connection(std::string const &Host, uint16_t Port, uv_tcp_t *Watcher, std::function<void(ConnectionType &Socket)> const &ReadCallback, ConnectionType &DerivedThis) :
-			Dead{false}, HasIdleData{false}, Host{Host}, Port{Port}, Watcher{Watcher}, ReadBuffer{*this}, ReadCallback{ReadCallback}, This(DerivedThis), WriteCounter(0)
+			Dead{false}, HasIdleData{false}, Host{Host}, Port{Port}, Watcher{Watcher}, ReadBuffer{*this}, ReadCallback{ReadCallback}, This(DerivedThis), WriteCounter(0), OutQueueBytes(0)
 		{
 			assert(Watcher);
 			Watcher->data = &DerivedThis;
@@ -74,41 +133,115 @@ template <typename ConnectionType> struct Network
 		// Network thread only
 		bool IsDead(void) { return Dead; }
 		uint64_t GetDiedAt(void) { assert(Dead); return DiedAt; }
+		std::string const &GetHost(void) const { return Host; }
+		uint16_t GetPort(void) const { return Port; }
 
-		void WakeIdleWrite(void) { if (Dead) return; if (HasIdleData) return; HasIdleData = true; HasIdleData = This.IdleWrite(); }
+		void WakeIdleWrite(void) { if (Dead) return; if (HasIdleData) return; HasIdleData = true; FillIdleWrite(); }
 
-		void RawSend(std::vector<uint8_t> const &Data)
+		// Output is corked: messages are queued and written together once per loop iteration or when enough bytes are queued
+		static constexpr size_t FlushThreshold = 64 * 1024;
+
+		// Past the soft limit droppable messages are discarded and idle writes pause; past the hard limit the peer is disconnected
+		static constexpr size_t SoftQueueLimit = 256 * 1024;
+		static constexpr size_t HardQueueLimit = 8 * 1024 * 1024;
+
+		// Bytes accepted for this connection but not yet written to the socket.  Reads the public field rather than
+		// uv_stream_get_write_queue_size, which needs libuv 1.19.
+		size_t QueuedBytes(void) const
+		{
+			if (Dead) return 0;
+			return OutQueueBytes + reinterpret_cast<uv_stream_t const *>(Watcher)->write_queue_size;
+		}
+
+		bool Congested(void) const { return QueuedBytes() > SoftQueueLimit; }
+
+		// Messages from versions the peer hasn't said it reads aren't sent to it, since it would drop the connection on
+		// them.  Every peer reads the first version.
+		void SetPeerVersion(Protocol::VersionIDT::Type Version) { PeerVersion = Version; }
+		Protocol::VersionIDT::Type GetPeerVersion(void) const { return PeerVersion; }
+		template <typename MessageType> bool Reads(void) const { return *MessageType::Version::ID <= PeerVersion; }
+
+		void RawSend(Protocol::GatherT Data, bool Droppable = false)
 		{
 			if (Dead) return;
-			uv_buf_t Buffers[1]{};
+			if (Data.Count() == 0) return;
+			auto const Size = Data.Size();
+			if (Droppable && Congested())
+			{
+				++Stats.Dropped;
+				return;
+			}
+			if (QueuedBytes() + Size > HardQueueLimit)
+			{
+				++Stats.Overflows;
+				Die();
+				return;
+			}
+			OutQueueBytes += Size;
+			OutQueue.push_back(std::move(Data));
+			++Stats.Messages;
+			if (OutQueueBytes >= FlushThreshold) Flush();
+		}
+
+		void Flush(void)
+		{
+			if (Dead) return;
+			if (OutQueue.empty()) return;
 
 			struct WriteRequestInfo : uv_write_t
 			{
 				ConnectionType &This;
-				std::vector<uint8_t> Data;
+				std::vector<Protocol::GatherT> Data;
 				uint64_t WriteID;
-				WriteRequestInfo(ConnectionType &This, std::vector<uint8_t> const &Data, uint64_t WriteID) : This(This), Data(Data), WriteID(WriteID) {}
+				WriteRequestInfo(ConnectionType &This, std::vector<Protocol::GatherT> &&Data, uint64_t WriteID) : This(This), Data(std::move(Data)), WriteID(WriteID) {}
 			};
-			auto Request = new WriteRequestInfo{This, Data, ++WriteCounter};
-
-			Buffers[0].base = reinterpret_cast<char *>(&Request->Data[0]);
-			Buffers[0].len = Request->Data.size();
-			int Error = uv_write(Request, reinterpret_cast<uv_stream_t *>(Watcher), Buffers, 1,
+			auto Request = new WriteRequestInfo{This, std::move(OutQueue), ++WriteCounter};
+			OutQueue.clear();
+			Stats.Bytes += OutQueueBytes;
+			OutQueueBytes = 0;
+			++Stats.Writes;
+
+			// libuv copies the buffer list, so it only needs to live for the uv_write call
+			FlushBuffers.clear();
+			for (auto const &Message : Request->Data)
+				Message.Each([&](uint8_t const *Data, size_t Length)
+					{ FlushBuffers.push_back(uv_buf_init(reinterpret_cast<char *>(const_cast<uint8_t *>(Data)), Length)); });
+
+			int Error = uv_write(Request, reinterpret_cast<uv_stream_t *>(Watcher), &FlushBuffers[0], FlushBuffers.size(),
 				[](uv_write_t *Request, int Error)
 				{
 					std::unique_ptr<WriteRequestInfo> Info(static_cast<WriteRequestInfo *>(Request));
 					if (Error) { Info->This.Die(); return; }
-					if ((Info->WriteID == Info->This.WriteCounter) && Info->This.HasIdleData) Info->This.HasIdleData = Info->This.IdleWrite();
+					if (Info->WriteID == Info->This.WriteCounter) Info->This.FillIdleWrite();
 				}
 			);
 			if (Error) Die();
 		}
 
+		struct WriteStatsT
+		{
+			uint64_t Messages = 0;
+			uint64_t Writes = 0;
+			uint64_t Bytes = 0;
+			uint64_t Dropped = 0;
+			uint64_t Overflows = 0;
+		};
+		WriteStatsT const &GetWriteStats(void) const { return Stats; }
+
 		template <typename MessageType, typename... ArgumentTypes> void Send(MessageType, ArgumentTypes const &... Arguments)
 		{
 			if (Dead) return;
-			auto Data = MessageType::Write(Arguments...);
-			RawSend(std::move(Data));
+			if (!Reads<MessageType>()) return;
+			RawSend(MessageType::Gather(Arguments...));
+		}
+
+		// For messages that are superseded by later ones (like clock ticks), dropped if the connection is congested
+		template <typename MessageType, typename... ArgumentTypes> void SendDroppable(MessageType, ArgumentTypes const &... Arguments)
+		{
+			if (Dead) return;
+			if (!Reads<MessageType>()) return;
+			if (Congested()) { ++Stats.Dropped; return; }
+			RawSend(MessageType::Gather(Arguments...), true);
 		}
 
 		void Die(void)
@@ -117,6 +250,8 @@ template <typename ConnectionType> struct Network
 
 			assert(Watcher);
 			uv_read_stop(reinterpret_cast<uv_stream_t *>(Watcher));
+			OutQueue.clear();
+			OutQueueBytes = 0;
 			uv_close(reinterpret_cast<uv_handle_t *>(Watcher), [](uv_handle_t *Watcher) { delete reinterpret_cast<uv_tcp_t *>(Watcher); });
 
 			Dead = true;
@@ -126,9 +261,18 @@ template <typename ConnectionType> struct Network
 		private:
 			friend struct Network<ConnectionType>;
 
+			// Batches idle writes until one causes a flush; that write's completion resumes if there's more
+			void FillIdleWrite(void)
+			{
+				auto const StartWriteCounter = WriteCounter;
+				while (!Dead && HasIdleData && (WriteCounter == StartWriteCounter) && !Congested())
+					HasIdleData = This.IdleWrite();
+			}
+
 			bool Dead;
 			uint64_t DiedAt;
 			bool HasIdleData;
+			Protocol::VersionIDT::Type PeerVersion = 0;
 
 			std::string Host;
 			uint16_t Port;
@@ -180,6 +324,10 @@ template <typename ConnectionType> struct Network
 			ConnectionType &This;
 
 			uint64_t WriteCounter;
+			std::vector<Protocol::GatherT> OutQueue;
+			size_t OutQueueBytes;
+			std::vector<uv_buf_t> FlushBuffers;
+			WriteStatsT Stats;
 	};
 
 	struct Listener
@@ -223,51 +371,82 @@ template <typename ConnectionType> struct Network
 	// Thread safe
 	void Open(bool Listen, std::string const &Host, uint16_t Port)
 	{
-		{
-			std::lock_guard<std::mutex> Lock(Mutex);
-			OpenQueue.emplace(Listen, Host, Port);
-		}
-		NotifyOpen();
+		if (OpenQueue.Push(OpenInfo{Listen, Host, Port})) NotifyOpen();
 	}
 
-	void Transfer(std::function<void(void)> const &Call)
+	void Transfer(CallT &&Call)
 	{
-		{
-			std::lock_guard<std::mutex> Lock(Mutex);
-			TransferQueue.emplace(Call);
-		}
-		NotifyTransfer();
+		if (TransferQueue.Push(std::move(Call))) NotifyTransfer();
 	}
 
-	void Schedule(float Seconds, std::function<void(void)> const &Call)
+	// Network thread only
+	// The handle can cancel the call until it's made
+	TimerWheel::HandleT Schedule(float Seconds, CallT &&Call)
 	{
-		{
-			std::lock_guard<std::mutex> Lock(Mutex);
-			ScheduleQueue.emplace(Seconds, Call);
-		}
-		NotifySchedule();
+		assert(std::this_thread::get_id() == Thread.get_id());
+		auto const Now = GetNow();
+		auto const Delay = static_cast<uint64_t>(std::max(0.0f, Seconds) * 1000 + 0.5f);
+		auto const Handle = Timers.Add(Now, Delay, std::move(Call));
+		if (Now + Delay < WheelDue) ArmWheel(Now, Now + Delay);
+		return Handle;
 	}
 
-	// Network thread only
+	bool Cancel(TimerWheel::HandleT const &Handle) { return Timers.Cancel(Handle); }
+	bool Pending(TimerWheel::HandleT const &Handle) const { return Timers.Pending(Handle); }
+
 	std::list<std::unique_ptr<ConnectionType>> const &GetConnections(void) { return Connections; }
 
 	template <typename MessageType, typename... ArgumentTypes> void Broadcast(MessageType, ArgumentTypes const &... Arguments)
 	{
-		auto const Data = MessageType::Write(Arguments...);
+		auto const Data = MessageType::Gather(Arguments...);
 		for (auto const &Connection : Connections)
-			Connection->RawSend(Data);
+			if (Connection->template Reads<MessageType>()) Connection->RawSend(Data);
+	}
+
+	template <typename MessageType, typename... ArgumentTypes> void BroadcastDroppable(MessageType, ArgumentTypes const &... Arguments)
+	{
+		auto const Data = MessageType::Gather(Arguments...);
+		for (auto const &Connection : Connections)
+			if (Connection->template Reads<MessageType>()) Connection->RawSend(Data, true);
 	}
 
 	template <typename MessageType, typename... ArgumentTypes> void Forward(MessageType, Connection const &From, ArgumentTypes const &... Arguments)
 	{
-		auto const Data = MessageType::Write(Arguments...);
+		auto const Data = MessageType::Gather(Arguments...);
 		for (auto &Connection : Connections)
 		{
 			if (&*Connection == &From) continue;
+			if (!Connection->template Reads<MessageType>()) continue;
 			Connection->RawSend(Data);
 		}
 	}
 
+	template <typename MessageType, typename... ArgumentTypes> void ForwardDroppable(MessageType, Connection const &From, ArgumentTypes const &... Arguments)
+	{
+		auto const Data = MessageType::Gather(Arguments...);
+		for (auto &Connection : Connections)
+		{
+			if (&*Connection == &From) continue;
+			if (!Connection->template Reads<MessageType>()) continue;
+			Connection->RawSend(Data, true);
+		}
+	}
+
+	typename Connection::WriteStatsT GetWriteStats(void)
+	{
+		auto Out = DeletedWriteStats;
+		for (auto &Connection : Connections)
+		{
+			auto const &Stats = Connection->GetWriteStats();
+			Out.Messages += Stats.Messages;
+			Out.Writes += Stats.Writes;
+			Out.Bytes += Stats.Bytes;
+			Out.Dropped += Stats.Dropped;
+			Out.Overflows += Stats.Overflows;
+		}
+		return Out;
+	}
+
 	OptionalT<uint64_t> IdleSince(void)
 	{
 		auto Out = DeletedIdleSince;
@@ -285,7 +464,6 @@ template <typename ConnectionType> struct Network
 		std::thread Thread;
 		std::function<void(void)> NotifyOpen;
 		std::function<void(void)> NotifyTransfer;
-		std::function<void(void)> NotifySchedule;
 
 		// Interface between other and event thread
 		mutable bool Die = false;
@@ -296,20 +474,25 @@ template <typename ConnectionType> struct Network
 			uint16_t Port;
 			OpenInfo(bool Listen, std::string const &Host, uint16_t Port) : Listen{Listen}, Host{Host}, Port{Port} {}
 		};
-		std::queue<OpenInfo> OpenQueue;
-		std::queue<std::function<void(void)>> TransferQueue;
-		struct ScheduleInfo
-		{
-			float Seconds;
-			std::function<void(void)> Callback;
-			ScheduleInfo(float Seconds, std::function<void(void)> const &Callback) : Seconds{Seconds}, Callback{Callback} {}
-		};
-		std::queue<ScheduleInfo> ScheduleQueue;
+		MPSCQueue<OpenInfo> OpenQueue;
+		MPSCQueue<CallT> TransferQueue;
 
 		// Net-thread only
 		OptionalT<uint64_t> DeletedIdleSince;
+		typename Connection::WriteStatsT DeletedWriteStats;
 		std::list<std::unique_ptr<ConnectionType>> Connections;
 
+		// Scheduled calls all run off one libuv timer, set for whenever the wheel next has something to do
+		TimerWheel Timers{GetNow()};
+		UVWatcherData<uv_timer_t> *WheelTimer = nullptr;
+		uint64_t WheelDue = std::numeric_limits<uint64_t>::max();
+
+		void ArmWheel(uint64_t Now, uint64_t Due)
+		{
+			WheelDue = Due;
+			uv_timer_start(WheelTimer, UVWatcherData<uv_timer_t>::PreCallback, Due > Now ? Due - Now : 0, 0);
+		}
+
 		// Thread implementation
 		template <typename ...MessageTypes> static void Run(Network *This, CreateConnectionCallback const &CreateConnection, OptionalT<float> TimerPeriod)
 		{
@@ -343,8 +526,16 @@ template <typename ConnectionType> struct Network
 				{
 					if ((*Connection)->IsDead())
 					{
+						if (((*Connection)->GetWriteStats().Overflows > 0) && This->LogCallback)
+							This->LogCallback(Local("Disconnected ^0:^1, too much data was waiting to be sent", (*Connection)->Host, (*Connection)->Port));
 						if (!This->DeletedIdleSince || ((*Connection)->GetDiedAt() > *This->DeletedIdleSince))
 							This->DeletedIdleSince = (*Connection)->GetDiedAt();
+						auto const &Stats = (*Connection)->GetWriteStats();
+						This->DeletedWriteStats.Messages += Stats.Messages;
+						This->DeletedWriteStats.Writes += Stats.Writes;
+						This->DeletedWriteStats.Bytes += Stats.Bytes;
+						This->DeletedWriteStats.Dropped += Stats.Dropped;
+						This->DeletedWriteStats.Overflows += Stats.Overflows;
 						Connection = This->Connections.erase(Connection);
 					}
 					else ++Connection;
@@ -356,23 +547,13 @@ template <typename ConnectionType> struct Network
 				/// Exit loop if dying
 				if (This->Die) { uv_stop(uv_default_loop()); return; }
 
-				while (true)
+				This->OpenQueue.Drain([&](OpenInfo const &Directive)
 				{
-					This->Mutex.lock();
-					if (This->OpenQueue.empty())
-					{
-						This->Mutex.unlock();
-						break;
-					}
-					auto Directive = This->OpenQueue.front();
-					This->OpenQueue.pop();
-					This->Mutex.unlock();
-
 					if (Directive.Listen)
 					{
 						Listener *Socket = nullptr;
 						try { Socket = new Listener{Directive.Host, Directive.Port}; }
-						catch (ConstructionErrorT &Error) { if (This->LogCallback) This->LogCallback(Error); continue; }
+						catch (ConstructionErrorT &Error) { if (This->LogCallback) This->LogCallback(Error); return; }
 						Listeners.emplace_back(Socket);
 						Socket->Watcher->Callback = [&, Socket](UVData<uv_tcp_t> *ListenWatcher)
 						{
@@ -438,65 +619,36 @@ template <typename ConnectionType> struct Network
 								{ AddressRequestInfo::Fix(static_cast<AddressRequestInfo *>(Info), Error, AddressInfo); },
 							HostString->c_str(), PortString->c_str(), nullptr);
 					}
-				}
+				});
 			});
 			uv_async_init(uv_default_loop(), AsyncOpenData, UVWatcherData<uv_async_t>::PreCallback);
 			This->NotifyOpen = [&AsyncOpenData](void) { uv_async_send(AsyncOpenData); };
 
 			auto AsyncTransferData = new UVWatcherData<uv_async_t>([&](UVWatcherData<uv_async_t> *)
 			{
-				while (true)
-				{
-					This->Mutex.lock();
-					if (This->TransferQueue.empty())
-					{
-						This->Mutex.unlock();
-						break;
-					}
-					auto Callback = This->TransferQueue.front();
-					This->TransferQueue.pop();
-					This->Mutex.unlock();
-
-					Callback();
-				}
+				This->TransferQueue.Drain([](CallT &Callback) { Callback(); });
 			});
 			uv_async_init(uv_default_loop(), AsyncTransferData, UVWatcherData<uv_async_t>::PreCallback);
 			This->NotifyTransfer = [&](void) { uv_async_send(AsyncTransferData); };
 
-			auto AsyncScheduleData = new UVWatcherData<uv_async_t>([&](UVWatcherData<uv_async_t> *)
+			This->WheelTimer = new UVWatcherData<uv_timer_t>([&](UVWatcherData<uv_timer_t> *)
 			{
-				while (true)
-				{
-					This->Mutex.lock();
-					if (This->ScheduleQueue.empty())
-					{
-						This->Mutex.unlock();
-						break;
-					}
-					auto Directive = This->ScheduleQueue.front();
-					This->ScheduleQueue.pop();
-					This->Mutex.unlock();
+				auto const Now = GetNow();
+				This->WheelDue = std::numeric_limits<uint64_t>::max();
+				This->Timers.Advance(Now);
+				if (!This->Timers.Count()) return;
+				auto const Due = This->Timers.NextDue();
+				if (Due < This->WheelDue) This->ArmWheel(Now, Due); // Callbacks may have armed it earlier
+			});
+			uv_timer_init(uv_default_loop(), This->WheelTimer);
+			TimerCallbacks.emplace_back(This->WheelTimer, TimerCallbackFree);
 
-					auto TimerData = new UVWatcherData<uv_timer_t>([&, Directive](UVWatcherData<uv_timer_t> *TimerData)
-					{
-						Directive.Callback();
-						for (auto Callback = TimerCallbacks.begin(); ; Callback++)
-						{
-							assert(Callback != TimerCallbacks.end());
-							if (Callback->get() == TimerData)
-							{
-								TimerCallbacks.erase(Callback);
-								break;
-							}
-						}
-					});
-					uv_timer_init(uv_default_loop(), TimerData);
-					TimerCallbacks.emplace_back(TimerData, TimerCallbackFree);
-					uv_timer_start(TimerData, UVWatcherData<uv_timer_t>::PreCallback, Directive.Seconds * 1000, 0);
-				}
+			auto FlushData = new UVWatcherData<uv_prepare_t>([&](UVWatcherData<uv_prepare_t> *)
+			{
+				for (auto &Connection : This->Connections) Connection->Flush();
 			});
-			uv_async_init(uv_default_loop(), AsyncScheduleData, UVWatcherData<uv_async_t>::PreCallback);
-			This->NotifySchedule = [&](void) { uv_async_send(AsyncScheduleData); };
+			uv_prepare_init(uv_default_loop(), FlushData);
+			uv_prepare_start(FlushData, UVWatcherData<uv_prepare_t>::PreCallback);
 
 			if (TimerPeriod)
 			{
@@ -522,7 +674,7 @@ template <typename ConnectionType> struct Network
 			TimerCallbacks.clear();
 			uv_close(reinterpret_cast<uv_handle_t *>(AsyncOpenData), [](uv_handle_t *Data) { delete reinterpret_cast<UVWatcherData<uv_async_t> *>(Data); });
 			uv_close(reinterpret_cast<uv_handle_t *>(AsyncTransferData), [](uv_handle_t *Data) { delete reinterpret_cast<UVWatcherData<uv_async_t> *>(Data); });
-			uv_close(reinterpret_cast<uv_handle_t *>(AsyncScheduleData), [](uv_handle_t *Data) { delete reinterpret_cast<UVWatcherData<uv_async_t> *>(Data); });
+			uv_close(reinterpret_cast<uv_handle_t *>(FlushData), [](uv_handle_t *Data) { delete reinterpret_cast<UVWatcherData<uv_prepare_t> *>(Data); });
 
 			uv_run(uv_default_loop(), UV_RUN_NOWAIT);
 		}
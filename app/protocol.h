@@ -15,6 +15,7 @@ Messages are completely redefined for each new version.
 #include "../ren-cxx-basics/type.h"
 
 #include <vector>
+#include <string>
 #include <functional>
 #include <limits>
 #include <cassert>
@@ -22,6 +23,9 @@ Messages are completely redefined for each new version.
 #include <memory>
 #include <type_traits>
 #include <typeinfo>
+#include <array>
+#include <tuple>
+#include <utility>
 
 #define DefineProtocol(Name) typedef Protocol::Protocol<__COUNTER__> Name;
 #define DefineProtocolVersion(Name, InProtocol) typedef Protocol::Version<static_cast<Protocol::VersionIDT::Type>(GetConstCount(InProtocol)), InProtocol> Name; IncrementConstCount(InProtocol)
@@ -47,6 +51,125 @@ template <typename ElementType> struct SubVector
 };
 typedef SubVector<uint8_t> BufferT;
 
+// Read-only views for message fields, encoded the same as std::vector and std::string.
+// When read, these point into the connection's receive buffer and are only valid for the duration of the Handle call.
+// When writing, a view with an Owner keeps the viewed memory alive so it can be sent without being copied.
+template <typename ElementType> struct ArrayView
+{
+	ArrayView(void) : Data{nullptr}, Length{0} {}
+	ArrayView(ElementType const *Data, size_t Length) : Data{Data}, Length{Length} {}
+	ArrayView(ElementType const *Data, size_t Length, std::shared_ptr<void const> const &Owner) : Data{Data}, Length{Length}, Owner{Owner} {}
+	ArrayView(std::vector<ElementType> const &Base) : Data{Base.empty() ? nullptr : &Base[0]}, Length{Base.size()} {}
+	ElementType const *Data;
+	size_t Length;
+	std::shared_ptr<void const> Owner;
+	size_t size(void) const { return Length; }
+	bool empty(void) const { return Length == 0; }
+	ElementType const *begin(void) const { return Data; }
+	ElementType const *end(void) const { return Data + Length; }
+	ElementType const &operator[](size_t Index) const { assert(Index < Length); return Data[Index]; }
+};
+
+struct StringView : ArrayView<char>
+{
+	StringView(void) {}
+	StringView(char const *Data, size_t Length) : ArrayView<char>{Data, Length} {}
+	StringView(std::string const &Base) : ArrayView<char>{Base.data(), Base.size()} {}
+	operator std::string(void) const { return std::string(Data, Length); }
+};
+
+// Scatter/gather message output.  The header and small fields are copied into an inline buffer (spilling onto the
+// heap if that fills up) and owned payloads are referenced, so a message can be handed to the socket as several buffers.
+struct GatherT
+{
+	static constexpr size_t InlineCapacity = 64;
+	static constexpr size_t ReferenceThreshold = 64;
+
+	GatherT(void) : InlineUsed{0} {}
+
+	// Appends Length bytes of owned space and returns it for writing; space that spilled is only valid until the next Extend
+	uint8_t *Extend(size_t Length)
+	{
+		if (InlineUsed + Length <= InlineCapacity)
+		{
+			Append(InlineSource, InlineUsed, nullptr, Length);
+			uint8_t *Out = &Inline[InlineUsed];
+			InlineUsed += Length;
+			return Out;
+		}
+		size_t const Start = Spill.size();
+		Spill.resize(Start + Length);
+		Append(SpillSource, Start, nullptr, Length);
+		return &Spill[Start];
+	}
+
+	// Appends Length bytes at Data without copying them; Owner must keep Data alive
+	void Reference(uint8_t const *Data, size_t Length, std::shared_ptr<void const> const &Owner)
+	{
+		if (Length == 0) return;
+		Owners.push_back(Owner);
+		Append(ExternalSource, 0, Data, Length);
+	}
+
+	size_t Size(void) const
+	{
+		size_t Out = 0;
+		for (auto const &Segment : Segments) Out += Segment.Length;
+		return Out;
+	}
+
+	size_t Count(void) const { return Segments.size(); }
+
+	// Callback is called with (uint8_t const *Data, size_t Length) for each buffer in order
+	template <typename CallbackType> void Each(CallbackType const &Callback) const
+	{
+		for (auto const &Segment : Segments)
+		{
+			switch (Segment.Source)
+			{
+				case InlineSource: Callback(&Inline[Segment.Offset], Segment.Length); break;
+				case SpillSource: Callback(&Spill[Segment.Offset], Segment.Length); break;
+				case ExternalSource: Callback(Segment.Data, Segment.Length); break;
+			}
+		}
+	}
+
+	std::vector<uint8_t> Flatten(void) const
+	{
+		std::vector<uint8_t> Out;
+		Out.reserve(Size());
+		Each([&Out](uint8_t const *Data, size_t Length) { Out.insert(Out.end(), Data, Data + Length); });
+		return Out;
+	}
+
+	private:
+		enum SourceT { InlineSource, SpillSource, ExternalSource };
+		struct SegmentT
+		{
+			SourceT Source;
+			size_t Offset;
+			uint8_t const *Data;
+			size_t Length;
+		};
+
+		void Append(SourceT Source, size_t Offset, uint8_t const *Data, size_t Length)
+		{
+			if (!Segments.empty() && (Source != ExternalSource))
+			{
+				auto &Last = Segments.back();
+				if ((Last.Source == Source) && (Last.Offset + Last.Length == Offset))
+					{ Last.Length += Length; return; }
+			}
+			Segments.push_back(SegmentT{Source, Offset, Data, Length});
+		}
+
+		std::array<uint8_t, InlineCapacity> Inline;
+		size_t InlineUsed;
+		std::vector<uint8_t> Spill;
+		std::vector<std::shared_ptr<void const>> Owners;
+		std::vector<SegmentT> Segments;
+};
+
 }
 
 template <typename Type, typename Enable = void> struct ProtocolOperations;
@@ -55,6 +178,8 @@ template <typename Type> constexpr size_t ProtocolGetSize(Type const &Argument)
 	{ return ProtocolOperations<Type>::GetSize(Argument); }
 template <typename Type> inline void ProtocolWrite(uint8_t *&Out, Type const &Argument)
 	{ return ProtocolOperations<Type>::Write(Out, Argument); }
+template <typename Type> inline void ProtocolGather(Protocol::GatherT &Out, Type const &Argument)
+	{ return ProtocolOperations<Type>::Gather(Out, Argument); }
 template <typename Type> bool ProtocolRead(Protocol::VersionIDT const &VersionID, Protocol::MessageIDT const &MessageID, Protocol::BufferT const &Buffer, Protocol::SizeT &Offset, Type &Data)
 	{ return ProtocolOperations<Type>::Read(VersionID, MessageID, Buffer, Offset, Data); }
 
@@ -77,92 +202,50 @@ template <MessageIDT::Type IDValue, typename InVersion, typename ...Definition>
 	typedef std::function<void(Definition const &...)> Function;
 	static constexpr MessageIDT ID{IDValue};
 
-	static std::vector<uint8_t> Write(Definition const &...Arguments)
+	// Single pass: the size field is filled in once the body has been gathered
+	static GatherT Gather(Definition const &...Arguments)
 	{
-		std::vector<uint8_t> Out;
-		auto RequiredSize = Size(Arguments...);
+		GatherT Out;
+		uint8_t *Header = Out.Extend(StrictCast(HeaderSize, size_t));
+		ProtocolWrite(Header, InVersion::ID);
+		ProtocolWrite(Header, ID);
+		Gather(Out, Arguments...);
+		auto const RequiredSize = Out.Size() - StrictCast(HeaderSize, size_t);
 		if (RequiredSize > std::numeric_limits<SizeT::Type>::max())
-			{ assert(false); return Out; }
-		Out.resize(StrictCast(HeaderSize, size_t) + RequiredSize);
-		uint8_t *WritePointer = &Out[0];
-		ProtocolWrite(WritePointer, InVersion::ID);
-		ProtocolWrite(WritePointer, ID);
-		ProtocolWrite(WritePointer, (SizeT::Type)RequiredSize);
-		Write(WritePointer, Arguments...);
+			{ assert(false); return {}; }
+		ProtocolWrite(Header, (SizeT::Type)RequiredSize);
 		return Out;
 	}
 
-	private:
-		template <typename NextType, typename... RemainingTypes>
-			static inline size_t Size(NextType NextArgument, RemainingTypes... RemainingArguments)
-			{ return ProtocolGetSize(NextArgument) + Size(RemainingArguments...); }
-
-		static constexpr size_t Size(void) { return {0}; }
+	static std::vector<uint8_t> Write(Definition const &...Arguments)
+		{ return Gather(Arguments...).Flatten(); }
 
+	private:
 		template <typename NextType, typename... RemainingTypes>
-			static inline void Write(uint8_t *&Out, NextType NextArgument, RemainingTypes... RemainingArguments)
+			static inline void Gather(GatherT &Out, NextType const &NextArgument, RemainingTypes const &... RemainingArguments)
 			{
-				ProtocolWrite(Out, NextArgument);
-				Write(Out, RemainingArguments...);
+				ProtocolGather(Out, NextArgument);
+				Gather(Out, RemainingArguments...);
 			}
 
-		static inline void Write(uint8_t *&) {}
+		static inline void Gather(GatherT &) {}
 
 };
 template <MessageIDT::Type IDValue, typename InVersion, typename ...Definition> constexpr MessageIDT Message<IDValue, InVersion, void(Definition...)>::ID;
 
 // Deserialization
-template <VersionIDT::Type CurrentVersionID, MessageIDT::Type CurrentMessageID, typename Enabled, typename ...MessageTypes> struct ReaderTupleElement;
-
-template
-<
-	VersionIDT::Type CurrentVersionID,
-	MessageIDT::Type CurrentMessageID,
-	typename MessageType,
-	typename ...RemainingMessageTypes
->
-struct ReaderTupleElement
-<
-	CurrentVersionID,
-	CurrentMessageID,
-	typename std::enable_if<(CurrentVersionID == *MessageType::Message::Version::ID) && (CurrentMessageID == *MessageType::Message::ID)>::type,
-	MessageType, RemainingMessageTypes...
->
-: ReaderTupleElement
-<
-	CurrentVersionID,
-	CurrentMessageID + 1,
-	void,
-	RemainingMessageTypes...
->
+template <typename MessageType> struct MessageReader;
+template <MessageIDT::Type IDValue, typename InVersion, typename ...Definition> struct MessageReader<Message<IDValue, InVersion, void(Definition...)>>
 {
-	private:
-		template <typename ParentType = MessageType> struct MessageDerivedTypes;
-		template <MessageIDT::Type ID, typename InVersion, typename ...Definition>
-			struct MessageDerivedTypes<Message<ID, InVersion, void(Definition...)>>
-		{
-			typedef std::tuple<Definition...> Tuple;
-		};
+	typedef Message<IDValue, InVersion, void(Definition...)> MessageType;
 
-		typedef ReaderTupleElement
-		<
-			CurrentVersionID,
-			CurrentMessageID + 1,
-			void,
-			RemainingMessageTypes...
-		> NextElement;
-
-	protected:
-		template <typename HandlerType, typename... ExtraTypes>
-			bool Read(HandlerType &Handler, VersionIDT const &VersionID, MessageIDT const &MessageID, BufferT const &Buffer, ExtraTypes const &... ExtraArguments)
-		{
-			if ((VersionID == MessageType::Version::ID) && (MessageID == MessageType::ID))
-			{
-				SizeT Offset{(SizeT::Type)0};
-				return ReadImplementation<HandlerType, typename MessageDerivedTypes<>::Tuple, std::tuple<ExtraTypes...>>::Read(Handler, VersionID, MessageID, Buffer, Offset, std::forward<ExtraTypes const &>(ExtraArguments)...);
-			}
-			return NextElement::Read(Handler, VersionID, MessageID, Buffer);
-		}
+	// Decodes the body of a single message type and passes it to the handler; one of these is generated per message per handler
+	template <typename HandlerType, typename... ExtraTypes>
+		static bool Read(HandlerType &Handler, VersionIDT const &VersionID, MessageIDT const &MessageID, BufferT const &Buffer, ExtraTypes const &... ExtraArguments)
+	{
+		SizeT Offset{(SizeT::Type)0};
+		return ReadImplementation<HandlerType, std::tuple<Definition...>, std::tuple<ExtraTypes...>>::Read(Handler, VersionID, MessageID, Buffer, Offset, std::forward<ExtraTypes const &>(ExtraArguments)...);
+	}
 
 	private:
 		template <typename HandlerType, typename UnreadTypes, typename ReadTypes> struct ReadImplementation {};
@@ -188,56 +271,6 @@ struct ReaderTupleElement
 		};
 };
 
-template
-<
-	VersionIDT::Type CurrentVersionID,
-	MessageIDT::Type CurrentMessageID,
-	typename MessageType,
-	typename ...RemainingMessageTypes
->
-struct ReaderTupleElement
-<
-	CurrentVersionID,
-	CurrentMessageID,
-	typename std::enable_if<(CurrentVersionID + 1 == *MessageType::Message::Version::ID)>::type,
-	MessageType, RemainingMessageTypes...
->
-: ReaderTupleElement
-<
-	CurrentVersionID + 1,
-	0,
-	void,
-	MessageType, RemainingMessageTypes...
->
-{
-	typedef ReaderTupleElement
-	<
-		CurrentVersionID + 1,
-		0,
-		void,
-		MessageType, RemainingMessageTypes...
-	> NextElement;
-};
-
-template
-<
-	VersionIDT::Type CurrentVersionID,
-	MessageIDT::Type CurrentMessageID
->
-struct ReaderTupleElement
-<
-	CurrentVersionID,
-	CurrentMessageID,
-	void
->
-{
-	template <typename HandlerType> bool Read(HandlerType &Handler, VersionIDT const &VersionID, MessageIDT const &MessageID, BufferT const &Buffer)
-	{
-		assert(false);
-		return false;
-	}
-};
-
 enum ReadResult
 {
 	Stop,
@@ -245,8 +278,10 @@ enum ReadResult
 	Error
 };
 
-template <typename ...MessageTypes> struct Reader : ReaderTupleElement<0, 0, void, MessageTypes...>
+template <typename ...MessageTypes> struct Reader
 {
+	static_assert(sizeof...(MessageTypes) > 0, "A reader needs at least one message type.");
+
 	// StreamType must have SubVector<uint8_t> const &Read(size_t Length, size_t Offset = 0) and void Consume(size_t) methods.
 	template <typename StreamType, typename HandlerType, typename... ExtraTypes> ReadResult Read(StreamType &&Stream, HandlerType &Handler, ExtraTypes const ...ExtraArguments)
 	{
@@ -259,7 +294,8 @@ template <typename ...MessageTypes> struct Reader : ReaderTupleElement<0, 0, voi
 		auto Body = Stream.Read(StrictCast(DataSize, size_t), StrictCast(HeaderSize, size_t));
 		if ((DataSize > SizeT(0)) && !Body) return Continue;
 
-		bool Out = HeadElement::Read(Handler, VersionID, MessageID, Body, ExtraArguments...);
+		auto const Handle = DispatchTable<HandlerType, ExtraTypes...>::Find(VersionID, MessageID);
+		bool Out = Handle && Handle(Handler, VersionID, MessageID, Body, ExtraArguments...);
 
 		Stream.Consume(StrictCast(HeaderSize + DataSize, size_t));
 
@@ -267,8 +303,68 @@ template <typename ...MessageTypes> struct Reader : ReaderTupleElement<0, 0, voi
 	}
 
 	private:
-		typedef ReaderTupleElement<0, 0, void, MessageTypes...> HeadElement;
+		// Message types must be listed in (version, message) order with no gaps, the same order they were defined in
+		static constexpr size_t MessageCount = sizeof...(MessageTypes);
+
+		static constexpr bool Ordered(void)
+		{
+			VersionIDT::Type const VersionIDs[] = {*MessageTypes::Version::ID...};
+			MessageIDT::Type const MessageIDs[] = {*MessageTypes::ID...};
+			if ((VersionIDs[0] != 0) || (MessageIDs[0] != 0)) return false;
+			for (size_t Index = 1; Index < MessageCount; ++Index)
+			{
+				if (VersionIDs[Index] == VersionIDs[Index - 1])
+				{
+					if (MessageIDs[Index] != MessageIDs[Index - 1] + 1) return false;
+				}
+				else if ((VersionIDs[Index] != VersionIDs[Index - 1] + 1) || (MessageIDs[Index] != 0)) return false;
+			}
+			return true;
+		}
+		static_assert(Ordered(), "Reader message types must be contiguous and ordered by version then message ID.");
+
+		static constexpr size_t VersionCount(void)
+		{
+			VersionIDT::Type const VersionIDs[] = {*MessageTypes::Version::ID...};
+			return VersionIDs[MessageCount - 1] + size_t(1);
+		}
+
+		// Index of the first message of a version in the flattened handler table
+		static constexpr size_t VersionStart(size_t Version)
+		{
+			VersionIDT::Type const VersionIDs[] = {*MessageTypes::Version::ID...};
+			size_t Out = 0;
+			while ((Out < MessageCount) && (VersionIDs[Out] < Version)) ++Out;
+			return Out;
+		}
+
+		template <size_t ...Versions> static constexpr std::array<size_t, sizeof...(Versions)> VersionStarts(std::index_sequence<Versions...>)
+			{ return {{VersionStart(Versions)...}}; }
+
+		// Two-level jump table: version -> range in Handlers, message ID -> offset into that range
+		template <typename HandlerType, typename... ExtraTypes> struct DispatchTable
+		{
+			typedef bool (*HandleT)(HandlerType &Handler, VersionIDT const &VersionID, MessageIDT const &MessageID, BufferT const &Buffer, ExtraTypes const &... ExtraArguments);
+
+			typedef std::array<size_t, VersionCount() + 1> VersionsT;
+			typedef std::array<HandleT, MessageCount> HandlersT;
+
+			static constexpr VersionsT Versions = VersionStarts(std::make_index_sequence<VersionCount() + 1>());
+			static constexpr HandlersT Handlers{{&MessageReader<MessageTypes>::template Read<HandlerType, ExtraTypes...>...}};
+
+			static HandleT Find(VersionIDT const &VersionID, MessageIDT const &MessageID)
+			{
+				if (*VersionID >= VersionCount()) return nullptr;
+				size_t const First = Versions[*VersionID];
+				if (*MessageID >= Versions[*VersionID + 1] - First) return nullptr;
+				return Handlers[First + *MessageID];
+			}
+		};
 };
+template <typename ...MessageTypes> template <typename HandlerType, typename... ExtraTypes>
+	constexpr typename Reader<MessageTypes...>::template DispatchTable<HandlerType, ExtraTypes...>::VersionsT Reader<MessageTypes...>::DispatchTable<HandlerType, ExtraTypes...>::Versions;
+template <typename ...MessageTypes> template <typename HandlerType, typename... ExtraTypes>
+	constexpr typename Reader<MessageTypes...>::template DispatchTable<HandlerType, ExtraTypes...>::HandlersT Reader<MessageTypes...>::DispatchTable<HandlerType, ExtraTypes...>::Handlers;
 
 }
 
@@ -8,6 +8,9 @@ template <typename IntT> struct ProtocolOperations<IntT, typename std::enable_if
 	inline static void Write(uint8_t *&Out, IntT const &Argument)
 		{ *reinterpret_cast<IntT *>(Out) = Argument; Out += sizeof(Argument); }
 
+	inline static void Gather(Protocol::GatherT &Out, IntT const &Argument)
+		{ uint8_t *Space = Out.Extend(sizeof(IntT)); Write(Space, Argument); }
+
 	static bool Read(Protocol::VersionIDT const &VersionID, Protocol::MessageIDT const &MessageID, Protocol::BufferT const &Buffer, Protocol::SizeT &Offset, IntT &Data)
 	{
 		if (Buffer.Length < StrictCast(Offset, size_t) + sizeof(IntT))
@@ -31,6 +34,9 @@ template <size_t Uniqueness, typename Type> struct ProtocolOperations<ExplicitCa
 	inline static void Write(uint8_t *&Out, Explicit const &Argument)
 		{ ProtocolOperations<Type>::Write(Out, *Argument); }
 
+	inline static void Gather(Protocol::GatherT &Out, Explicit const &Argument)
+		{ ProtocolOperations<Type>::Gather(Out, *Argument); }
+
 	static bool Read(Protocol::VersionIDT const &VersionID, Protocol::MessageIDT const &MessageID, Protocol::BufferT const &Buffer, Protocol::SizeT &Offset, Explicit &Data)
 		{ return ProtocolOperations<Type>::Read(VersionID, MessageID, Buffer, Offset, *Data); }
 };
@@ -51,6 +57,9 @@ template <> struct ProtocolOperations<std::string, void>
 		Out += Argument.size();
 	}
 
+	inline static void Gather(Protocol::GatherT &Out, std::string const &Argument)
+		{ uint8_t *Space = Out.Extend(GetSize(Argument)); Write(Space, Argument); }
+
 	static bool Read(Protocol::VersionIDT const &VersionID, Protocol::MessageIDT const &MessageID, Protocol::BufferT const &Buffer, Protocol::SizeT &Offset, std::string &Data)
 	{
 		if (Buffer.Length < StrictCast(Offset, size_t) + Protocol::ArraySizeT::Size)
@@ -87,6 +96,9 @@ template <typename ElementType> struct ProtocolOperations<std::vector<ElementTyp
 		Out += Argument.size() * sizeof(ElementType);
 	}
 
+	inline static void Gather(Protocol::GatherT &Out, std::vector<ElementType> const &Argument)
+		{ uint8_t *Space = Out.Extend(GetSize(Argument)); Write(Space, Argument); }
+
 	static bool Read(Protocol::VersionIDT const &VersionID, Protocol::MessageIDT const &MessageID, Protocol::BufferT const &Buffer, Protocol::SizeT &Offset, std::vector<ElementType> &Data)
 	{
 		if (Buffer.Length < StrictCast(Offset, size_t) + Protocol::ArraySizeT::Size)
@@ -128,6 +140,14 @@ template <typename ElementType> struct ProtocolOperations<std::vector<ElementTyp
 			ProtocolWrite(Out, Argument[*ElementIndex]);
 	}
 
+	inline static void Gather(Protocol::GatherT &Out, std::vector<ElementType> const &Argument)
+	{
+		Protocol::ArraySizeT const ArraySize = Protocol::ArraySizeT(Argument.size());
+		ProtocolGather(Out, *ArraySize);
+		for (Protocol::ArraySizeT ElementIndex = Protocol::ArraySizeT(0); ElementIndex < ArraySize; ++ElementIndex)
+			ProtocolGather(Out, Argument[*ElementIndex]);
+	}
+
 	static bool Read(Protocol::VersionIDT const &VersionID, Protocol::MessageIDT const &MessageID, Protocol::BufferT const &Buffer, Protocol::SizeT &Offset, std::vector<ElementType> &Data)
 	{
 		if (Buffer.Length < StrictCast(Offset, size_t) + Protocol::ArraySizeT::Size) { assert(false); return false; }
@@ -141,6 +161,70 @@ template <typename ElementType> struct ProtocolOperations<std::vector<ElementTyp
 	}
 };
 
+template <typename ElementType> struct ProtocolOperations<Protocol::ArrayView<ElementType>, typename std::enable_if<!std::is_class<ElementType>::value && (sizeof(ElementType) == 1)>::type>
+{
+	static size_t GetSize(Protocol::ArrayView<ElementType> const &Argument)
+	{
+		assert(Argument.Length <= std::numeric_limits<Protocol::ArraySizeT::Type>::max());
+		return Protocol::ArraySizeT::Size + Argument.Length;
+	}
+
+	inline static void Write(uint8_t *&Out, Protocol::ArrayView<ElementType> const &Argument)
+	{
+		Protocol::ArraySizeT const ArraySize = Protocol::ArraySizeT(Argument.Length);
+		ProtocolWrite(Out, *ArraySize);
+		if (Argument.Length > 0) memcpy(Out, Argument.Data, Argument.Length);
+		Out += Argument.Length;
+	}
+
+	inline static void Gather(Protocol::GatherT &Out, Protocol::ArrayView<ElementType> const &Argument)
+	{
+		if (!Argument.Owner || (Argument.Length < Protocol::GatherT::ReferenceThreshold))
+		{
+			uint8_t *Space = Out.Extend(GetSize(Argument));
+			Write(Space, Argument);
+			return;
+		}
+		Protocol::ArraySizeT const ArraySize = Protocol::ArraySizeT(Argument.Length);
+		ProtocolGather(Out, *ArraySize);
+		Out.Reference(reinterpret_cast<uint8_t const *>(Argument.Data), Argument.Length, Argument.Owner);
+	}
+
+	static bool Read(Protocol::VersionIDT const &VersionID, Protocol::MessageIDT const &MessageID, Protocol::BufferT const &Buffer, Protocol::SizeT &Offset, Protocol::ArrayView<ElementType> &Data)
+	{
+		if (Buffer.Length < StrictCast(Offset, size_t) + Protocol::ArraySizeT::Size)
+		{
+			assert(false);
+			return false;
+		}
+		Protocol::ArraySizeT::Type const &Size = *reinterpret_cast<Protocol::ArraySizeT::Type const *>(&Buffer[*Offset]);
+		Offset += static_cast<Protocol::SizeT::Type>(sizeof(Size));
+		if (Buffer.Length < StrictCast(Offset, size_t) + (size_t)Size)
+		{
+			assert(false);
+			return false;
+		}
+		Data = Protocol::ArrayView<ElementType>{Size > 0 ? reinterpret_cast<ElementType const *>(&Buffer[*Offset]) : nullptr, Size};
+		Offset += Size;
+		return true;
+	}
+};
+
+template <> struct ProtocolOperations<Protocol::StringView, void>
+{
+	static size_t GetSize(Protocol::StringView const &Argument)
+		{ return ProtocolOperations<Protocol::ArrayView<char>>::GetSize(Argument); }
+
+	inline static void Write(uint8_t *&Out, Protocol::StringView const &Argument)
+		{ ProtocolOperations<Protocol::ArrayView<char>>::Write(Out, Argument); }
+
+	inline static void Gather(Protocol::GatherT &Out, Protocol::StringView const &Argument)
+		{ ProtocolOperations<Protocol::ArrayView<char>>::Gather(Out, Argument); }
+
+	static bool Read(Protocol::VersionIDT const &VersionID, Protocol::MessageIDT const &MessageID, Protocol::BufferT const &Buffer, Protocol::SizeT &Offset, Protocol::StringView &Data)
+		{ return ProtocolOperations<Protocol::ArrayView<char>>::Read(VersionID, MessageID, Buffer, Offset, Data); }
+};
+
 template <typename ElementType, size_t Count> struct ProtocolOperations<std::array<ElementType, Count>, typename std::enable_if<!std::is_class<ElementType>::value>::type>
 {
 	constexpr static size_t GetSize(std::array<ElementType, Count> const &Argument)
@@ -152,6 +236,9 @@ template <typename ElementType, size_t Count> struct ProtocolOperations<std::arr
 		Out += Count * sizeof(ElementType);
 	}
 
+	inline static void Gather(Protocol::GatherT &Out, std::array<ElementType, Count> const &Argument)
+		{ uint8_t *Space = Out.Extend(GetSize(Argument)); Write(Space, Argument); }
+
 	static bool Read(Protocol::VersionIDT const &VersionID, Protocol::MessageIDT const &MessageID, Protocol::BufferT const &Buffer, Protocol::SizeT &Offset, std::array<ElementType, Count> &Data)
 	{
 		if (Buffer.Length < Count * sizeof(ElementType))
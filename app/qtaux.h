@@ -4,29 +4,24 @@
 #include "shared.h"
 
 #include <QObject>
-#include <QMetaType>
 #include <functional>
 #include <memory>
 
-Q_DECLARE_METATYPE(std::function<void(void)>)
+// Calls are queued lock-free and run in batches; only the first call into an empty queue posts a Qt event
 struct QTCrossThread : QObject, CallTransferType
 {
 	QTCrossThread(QObject *Parent) : QObject(Parent)
 	{
-		struct RegisterTypes { RegisterTypes(void)
-		{
-			qRegisterMetaType<std::function<void(void)>>();
-		}};
-		static RegisterTypes Registration{};
 		QObject::connect(this, &QTCrossThread::Send, this, &QTCrossThread::Receive);
 	}
-	inline void Transfer(std::function<void(void)> const &Call) override { Send(Call); }
+	inline void Transfer(CallT &&Call) override { if (Calls.Push(std::move(Call))) Send(); }
 	private slots:
-		void Receive(std::function<void(void)> Function) { Function(); }
+		void Receive(void) { Calls.Drain([](CallT &Call) { Call(); }); }
 	signals:
-		void Send(std::function<void(void)> Function);
+		void Send(void);
 	private:
 		Q_OBJECT
+		MPSCQueue<CallT> Calls;
 };
 
 template <typename DataType> struct QTStorage : QObject
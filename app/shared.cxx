@@ -2,41 +2,57 @@
 
 #include <chrono>
 #include <ctime>
-#if defined(WINDOWS)
-#include <stdlib.h>
-#include <time.h>
-#endif
 
-static std::chrono::system_clock::time_point CalculateEpoch(void)
+// 2000-01-01 00:00:00 UTC
+static auto const Epoch = std::chrono::system_clock::from_time_t(946684800);
+
+// Local time is steady, anchored to the wall clock once at startup so later wall clock adjustments don't move it
+static auto const SteadyStart = std::chrono::steady_clock::now();
+static uint64_t const WallStart = (std::chrono::system_clock::now() - Epoch) / std::chrono::milliseconds(1);
+
+uint64_t GetNow(void) { return WallStart + (std::chrono::steady_clock::now() - SteadyStart) / std::chrono::milliseconds(1); }
+
+CallTransferType::~CallTransferType(void) {}
+
+void CallTransferType::operator ()(CallT &&Call) { Transfer(std::move(Call)); }
+
+WorkerPool::WorkerPool(size_t Count) : Dying{false}
 {
-	std::tm Calendar{};
-	Calendar.tm_year = 100;
-
-	auto OriginalTZ = getenv("TZ");
-#if defined(WINDOWS)
-	_putenv("TZ=UTC");
-	_tzset();
-#else
-	setenv("TZ", "UTC", 1);
-	tzset();
-#endif
-	auto Out = std::chrono::system_clock::from_time_t(std::mktime(&Calendar));
-#if defined(WINDOWS)
-	if (OriginalTZ) _putenv((std::string("TZ=") + OriginalTZ).c_str());
-	else _putenv("TZ=");
-	_tzset();
-#else
-	if (OriginalTZ) setenv("TZ", OriginalTZ, 1);
-	else unsetenv("TZ");
-	tzset();
-#endif
-
-	return Out;
+	for (size_t Index = 0; Index < Count; ++Index) Threads.emplace_back(&WorkerPool::Run, this);
 }
-static auto const Epoch = CalculateEpoch();
 
-uint64_t GetNow(void) { return (std::chrono::system_clock::now() - Epoch) / std::chrono::milliseconds(1); }
+WorkerPool::~WorkerPool(void)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		Dying = true;
+		Calls.clear();
+	}
+	Wake.notify_all();
+	for (auto &Thread : Threads) Thread.join();
+}
 
-CallTransferType::~CallTransferType(void) {}
+void WorkerPool::Queue(CallT &&Call)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		Calls.push_back(std::move(Call));
+	}
+	Wake.notify_one();
+}
 
-void CallTransferType::operator ()(std::function<void(void)> const &Call) { Transfer(Call); }
+void WorkerPool::Run(void)
+{
+	while (true)
+	{
+		CallT Call;
+		{
+			std::unique_lock<std::mutex> Lock(Mutex);
+			Wake.wait(Lock, [this](void) { return Dying || !Calls.empty(); });
+			if (Dying) return;
+			Call = std::move(Calls.front());
+			Calls.pop_front();
+		}
+		Call();
+	}
+}
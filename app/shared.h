@@ -2,16 +2,253 @@
 #define shared_h
 
 #include <cstdint>
+#include <cstddef>
+#include <atomic>
 #include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
+// Local time in ms.  Monotonic, but starts at the wall clock time since the network epoch so it's roughly comparable
+// with other instances; times from peers are corrected with the estimated peer clock offsets as they're received.
 uint64_t GetNow(void);
 
+// A move-only void(void) callable.  Functions that fit InlineSize are stored in place, so passing small lambdas
+// between threads doesn't allocate.
+struct CallT
+{
+	static constexpr size_t InlineSize = 6 * sizeof(void *);
+
+	CallT(void) : Operations{nullptr} {}
+	template <typename FunctionType, typename = typename std::enable_if<!std::is_same<typename std::decay<FunctionType>::type, CallT>::value>::type>
+		CallT(FunctionType &&Function) : Operations{nullptr}
+	{
+		using StoredType = typename std::decay<FunctionType>::type;
+		Construct<StoredType>(std::forward<FunctionType>(Function), std::integral_constant<bool,
+			(sizeof(StoredType) <= InlineSize) &&
+			(alignof(StoredType) <= alignof(void *)) &&
+			std::is_nothrow_move_constructible<StoredType>::value>{});
+	}
+	CallT(CallT &&Other) : Operations{Other.Operations}
+	{
+		if (!Operations) return;
+		Operations->Move(&Other.Storage, &Storage);
+		Other.Operations = nullptr;
+	}
+	CallT &operator =(CallT &&Other)
+	{
+		if (&Other == this) return *this;
+		Reset();
+		Operations = Other.Operations;
+		if (!Operations) return *this;
+		Operations->Move(&Other.Storage, &Storage);
+		Other.Operations = nullptr;
+		return *this;
+	}
+	CallT(CallT const &) = delete;
+	CallT &operator =(CallT const &) = delete;
+	~CallT(void) { Reset(); }
+
+	explicit operator bool(void) const { return Operations; }
+	void operator ()(void) { Operations->Call(&Storage); }
+
+	private:
+		struct OperationsT
+		{
+			void (*Call)(void *Storage);
+			void (*Move)(void *From, void *To); // Leaves From destroyed
+			void (*Destroy)(void *Storage);
+		};
+
+		template <typename FunctionType> struct InlineOperations
+		{
+			static void Call(void *Storage) { (*static_cast<FunctionType *>(Storage))(); }
+			static void Move(void *From, void *To)
+			{
+				auto &Source = *static_cast<FunctionType *>(From);
+				new (To) FunctionType(std::move(Source));
+				Source.~FunctionType();
+			}
+			static void Destroy(void *Storage) { static_cast<FunctionType *>(Storage)->~FunctionType(); }
+			static constexpr OperationsT Table{Call, Move, Destroy};
+		};
+
+		template <typename FunctionType> struct HeapOperations
+		{
+			static FunctionType *&Get(void *Storage) { return *static_cast<FunctionType **>(Storage); }
+			static void Call(void *Storage) { (*Get(Storage))(); }
+			static void Move(void *From, void *To) { new (To) FunctionType *(Get(From)); }
+			static void Destroy(void *Storage) { delete Get(Storage); }
+			static constexpr OperationsT Table{Call, Move, Destroy};
+		};
+
+		template <typename StoredType, typename FunctionType> void Construct(FunctionType &&Function, std::true_type)
+		{
+			new (&Storage) StoredType(std::forward<FunctionType>(Function));
+			Operations = &InlineOperations<StoredType>::Table;
+		}
+
+		template <typename StoredType, typename FunctionType> void Construct(FunctionType &&Function, std::false_type)
+		{
+			new (&Storage) StoredType *(new StoredType(std::forward<FunctionType>(Function)));
+			Operations = &HeapOperations<StoredType>::Table;
+		}
+
+		void Reset(void)
+		{
+			if (!Operations) return;
+			Operations->Destroy(&Storage);
+			Operations = nullptr;
+		}
+
+		OperationsT const *Operations;
+		typename std::aligned_storage<InlineSize, alignof(void *)>::type Storage;
+};
+
+template <typename FunctionType> constexpr CallT::OperationsT CallT::InlineOperations<FunctionType>::Table;
+template <typename FunctionType> constexpr CallT::OperationsT CallT::HeapOperations<FunctionType>::Table;
+
+// Multiple producer, single consumer queue.  Pushing is lock-free, and the consumer takes everything queued so far
+// in one step, so a burst of calls costs one wakeup and no locking on either side.  Nodes come from a fixed pool and
+// are recycled by the consumer, so pushing only allocates when more than PoolSize values are waiting.
+template <typename ValueType> struct MPSCQueue
+{
+	MPSCQueue(uint32_t PoolSize = 256) : Head{nullptr}, Pool{new NodeT[PoolSize]}, FreeHead{None}
+	{
+		for (uint32_t Index = PoolSize; Index-- > 0;)
+		{
+			Pool[Index].Pooled = true;
+			Recycle(&Pool[Index]);
+		}
+	}
+	MPSCQueue(MPSCQueue const &) = delete;
+	MPSCQueue &operator =(MPSCQueue const &) = delete;
+	~MPSCQueue(void)
+	{
+		auto Node = Head.exchange(nullptr, std::memory_order_acquire);
+		while (Node)
+		{
+			auto Next = Node->Next;
+			Node->Get().~ValueType();
+			if (!Node->Pooled) delete Node;
+			Node = Next;
+		}
+	}
+
+	// Any thread.  Returns true if the queue was empty; only then does the consumer need waking, since an earlier
+	// push already woke it for anything behind this.
+	bool Push(ValueType &&Value)
+	{
+		auto Node = Allocate();
+		new (&Node->Storage) ValueType(std::move(Value));
+		// Node belongs to the consumer once it's in, so the previous head is kept aside
+		auto Next = Head.load(std::memory_order_relaxed);
+		do Node->Next = Next;
+		while (!Head.compare_exchange_weak(Next, Node, std::memory_order_release, std::memory_order_relaxed));
+		return !Next;
+	}
+
+	// Consumer thread only.  Calls Callback on each value in push order, returns how many there were.  Values pushed
+	// while draining are left for the next drain.
+	template <typename CallbackType> size_t Drain(CallbackType &&Callback)
+	{
+		// The list is newest first
+		NodeT *Ordered = nullptr;
+		auto Node = Head.exchange(nullptr, std::memory_order_acquire);
+		while (Node)
+		{
+			auto Next = Node->Next;
+			Node->Next = Ordered;
+			Ordered = Node;
+			Node = Next;
+		}
+		size_t Count = 0;
+		while (Ordered)
+		{
+			auto Done = Ordered;
+			Ordered = Ordered->Next;
+			Callback(Done->Get());
+			Done->Get().~ValueType();
+			if (Done->Pooled) Recycle(Done);
+			else delete Done;
+			++Count;
+		}
+		return Count;
+	}
+
+	private:
+		struct NodeT
+		{
+			typename std::aligned_storage<sizeof(ValueType), alignof(ValueType)>::type Storage;
+			NodeT *Next = nullptr;
+			std::atomic<uint32_t> NextFree{None};
+			bool Pooled = false;
+			ValueType &Get(void) { return *reinterpret_cast<ValueType *>(&Storage); }
+		};
+
+		// The free list head is a pool index with a count of changes in the high half, so a pop that raced with
+		// another pop and push of the same node fails instead of linking in a stale next index
+		static constexpr uint32_t None = 0xFFFFFFFF;
+		static uint64_t Pack(uint64_t Old, uint32_t Index) { return (((Old >> 32) + 1) << 32) | Index; }
+
+		NodeT *Allocate(void)
+		{
+			auto Free = FreeHead.load(std::memory_order_acquire);
+			while (true)
+			{
+				auto const Index = static_cast<uint32_t>(Free);
+				if (Index == None) return new NodeT;
+				auto const Next = Pool[Index].NextFree.load(std::memory_order_relaxed);
+				if (FreeHead.compare_exchange_weak(Free, Pack(Free, Next), std::memory_order_acquire, std::memory_order_acquire))
+					return &Pool[Index];
+			}
+		}
+
+		void Recycle(NodeT *Node)
+		{
+			auto const Index = static_cast<uint32_t>(Node - &Pool[0]);
+			auto Free = FreeHead.load(std::memory_order_relaxed);
+			do Node->NextFree.store(static_cast<uint32_t>(Free), std::memory_order_relaxed);
+			while (!FreeHead.compare_exchange_weak(Free, Pack(Free, Index), std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		std::atomic<NodeT *> Head;
+		std::unique_ptr<NodeT[]> Pool;
+		std::atomic<uint64_t> FreeHead;
+};
+
+template <typename ValueType> constexpr uint32_t MPSCQueue<ValueType>::None;
+
 // For making a call occur from a different thread; generally queued and idly executed
 struct CallTransferType
 {
 	virtual ~CallTransferType(void);
-	virtual void Transfer(std::function<void(void)> const &Call) = 0;
-	void operator ()(std::function<void(void)> const &Call);
+	virtual void Transfer(CallT &&Call) = 0;
+	void operator ()(CallT &&Call);
+};
+
+// Runs calls on background threads, for slow work that shouldn't hold up the calling thread.  Calls still queued
+// when the pool is destroyed are dropped.
+struct WorkerPool
+{
+	WorkerPool(size_t Count);
+	~WorkerPool(void);
+	void Queue(CallT &&Call);
+
+	private:
+		void Run(void);
+
+		std::mutex Mutex;
+		std::condition_variable Wake;
+		bool Dying;
+		std::deque<CallT> Calls;
+		std::vector<std::thread> Threads;
 };
 
 #endif
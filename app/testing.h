@@ -0,0 +1,29 @@
+#ifndef testing_h
+#define testing_h
+
+// Support for the test programs.  Each is run by the build; a failed check makes it exit non-zero.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+inline int &TestFailures(void) { static int Out = 0; return Out; }
+
+#define Check(Condition) \
+	do { if (!(Condition)) { std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #Condition); ++TestFailures(); } } while (0)
+
+inline int TestResult(void)
+{
+	if (TestFailures()) std::fprintf(stderr, "%d checks failed\n", TestFailures());
+	return TestFailures() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Average ns per iteration of Count calls of Function
+template <typename FunctionType> double TimePer(size_t Count, FunctionType const &Function)
+{
+	auto const Start = std::chrono::steady_clock::now();
+	for (size_t Index = 0; Index < Count; ++Index) Function(Index);
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - Start).count() / Count;
+}
+
+#endif
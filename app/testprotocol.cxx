@@ -0,0 +1,195 @@
+#include "testing.h"
+#include "protocol.h"
+#include "protocoloperations.h"
+
+#include <array>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Checks message dispatch and times it against the reader it replaced.  Dispatch is a table lookup, so the last
+// message of the last version should cost the same as the first; the old chain compared IDs message by message.
+
+DefineProtocol(TestProto)
+
+DefineProtocolVersion(TPV1, TestProto)
+DefineProtocolMessage(TPV1A, TPV1, void(uint64_t Value))
+DefineProtocolMessage(TPV1B, TPV1, void(std::string Text))
+DefineProtocolMessage(TPV1C, TPV1, void(uint64_t Value, std::string Text))
+DefineProtocolMessage(TPV1D, TPV1, void(void))
+DefineProtocolMessage(TPV1E, TPV1, void(uint64_t Value))
+DefineProtocolMessage(TPV1F, TPV1, void(uint64_t Value))
+
+DefineProtocolVersion(TPV2, TestProto)
+DefineProtocolMessage(TPV2A, TPV2, void(uint64_t Value))
+DefineProtocolMessage(TPV2B, TPV2, void(Protocol::ArrayView<uint8_t> Bytes))
+
+DefineProtocolVersion(TPV3, TestProto)
+DefineProtocolMessage(TPV3A, TPV3, void(uint64_t Value))
+DefineProtocolMessage(TPV3B, TPV3, void(uint64_t Value))
+DefineProtocolMessage(TPV3C, TPV3, void(uint64_t Value))
+DefineProtocolMessage(TPV3D, TPV3, void(uint64_t Value))
+
+typedef Protocol::Reader<TPV1A, TPV1B, TPV1C, TPV1D, TPV1E, TPV1F, TPV2A, TPV2B, TPV3A, TPV3B, TPV3C, TPV3D> TestReader;
+
+// The reader before the dispatch table: each message in turn compares its version and message ID
+template <typename... MessageTypes> struct ChainElement;
+template <typename MessageType, typename... RemainingTypes> struct ChainElement<MessageType, RemainingTypes...>
+{
+	template <typename HandlerType>
+		static bool Read(HandlerType &Handler, Protocol::VersionIDT const &VersionID, Protocol::MessageIDT const &MessageID, Protocol::BufferT const &Buffer)
+	{
+		if ((VersionID == MessageType::Version::ID) && (MessageID == MessageType::ID))
+			return Protocol::MessageReader<MessageType>::Read(Handler, VersionID, MessageID, Buffer);
+		return ChainElement<RemainingTypes...>::Read(Handler, VersionID, MessageID, Buffer);
+	}
+};
+template <> struct ChainElement<>
+{
+	template <typename HandlerType>
+		static bool Read(HandlerType &, Protocol::VersionIDT const &, Protocol::MessageIDT const &, Protocol::BufferT const &)
+		{ return false; }
+};
+
+template <typename... MessageTypes> struct ChainReader
+{
+	template <typename StreamType, typename HandlerType> Protocol::ReadResult Read(StreamType &&Stream, HandlerType &Handler)
+	{
+		auto Header = Stream.Read(StrictCast(Protocol::HeaderSize, size_t));
+		if (!Header) return Protocol::Continue;
+		Protocol::VersionIDT const VersionID = *reinterpret_cast<Protocol::VersionIDT *>(&Header[0]);
+		Protocol::MessageIDT const MessageID = *reinterpret_cast<Protocol::MessageIDT *>(&Header[Protocol::VersionIDT::Size]);
+		Protocol::SizeT const DataSize = *reinterpret_cast<Protocol::SizeT *>(&Header[Protocol::VersionIDT::Size + Protocol::MessageIDT::Size]);
+
+		auto Body = Stream.Read(StrictCast(DataSize, size_t), StrictCast(Protocol::HeaderSize, size_t));
+		if ((DataSize > Protocol::SizeT(0)) && !Body) return Protocol::Continue;
+
+		bool Out = ChainElement<MessageTypes...>::Read(Handler, VersionID, MessageID, Body);
+
+		Stream.Consume(StrictCast(Protocol::HeaderSize + DataSize, size_t));
+
+		return Out ? Protocol::Stop : Protocol::Error;
+	}
+};
+
+typedef ChainReader<TPV1A, TPV1B, TPV1C, TPV1D, TPV1E, TPV1F, TPV2A, TPV2B, TPV3A, TPV3B, TPV3C, TPV3D> TestChainReader;
+
+struct TestHandler
+{
+	std::array<uint64_t, 12> Seen{};
+	uint64_t Sum = 0;
+
+	void Handle(TPV1A, uint64_t const &Value) { ++Seen[0]; Sum += Value; }
+	void Handle(TPV1B, std::string const &Text) { ++Seen[1]; Sum += Text.size(); }
+	void Handle(TPV1C, uint64_t const &Value, std::string const &Text) { ++Seen[2]; Sum += Value + Text.size(); }
+	void Handle(TPV1D) { ++Seen[3]; }
+	void Handle(TPV1E, uint64_t const &Value) { ++Seen[4]; Sum += Value; }
+	void Handle(TPV1F, uint64_t const &Value) { ++Seen[5]; Sum += Value; }
+	void Handle(TPV2A, uint64_t const &Value) { ++Seen[6]; Sum += Value; }
+	void Handle(TPV2B, Protocol::ArrayView<uint8_t> const &Bytes) { ++Seen[7]; Sum += Bytes.size(); }
+	void Handle(TPV3A, uint64_t const &Value) { ++Seen[8]; Sum += Value; }
+	void Handle(TPV3B, uint64_t const &Value) { ++Seen[9]; Sum += Value; }
+	void Handle(TPV3C, uint64_t const &Value) { ++Seen[10]; Sum += Value; }
+	void Handle(TPV3D, uint64_t const &Value) { ++Seen[11]; Sum += Value; }
+};
+
+// Reads from a fixed buffer, starting over at the end
+struct TestStream
+{
+	std::vector<uint8_t> Buffer;
+	size_t Start = 0;
+
+	void Append(std::vector<uint8_t> const &Message) { Buffer.insert(Buffer.end(), Message.begin(), Message.end()); }
+
+	Protocol::SubVector<uint8_t> Read(size_t Length, size_t Offset = 0)
+	{
+		if (Length == 0) return {};
+		if (Start + Offset + Length > Buffer.size()) return {};
+		return {Buffer, Start + Offset, Length};
+	}
+
+	void Consume(size_t Length)
+	{
+		Start += Length;
+		if (Start == Buffer.size()) Start = 0;
+	}
+};
+
+template <typename ReaderType> static void CheckDispatch(void)
+{
+	TestStream Stream;
+	Stream.Append(TPV1A::Write(1));
+	Stream.Append(TPV1B::Write("ab"));
+	Stream.Append(TPV1C::Write(3, "abc"));
+	Stream.Append(TPV1D::Write());
+	Stream.Append(TPV1E::Write(5));
+	Stream.Append(TPV1F::Write(6));
+	Stream.Append(TPV2A::Write(7));
+	Stream.Append(TPV2B::Write(std::vector<uint8_t>(8)));
+	Stream.Append(TPV3A::Write(9));
+	Stream.Append(TPV3B::Write(10));
+	Stream.Append(TPV3C::Write(11));
+	Stream.Append(TPV3D::Write(12));
+
+	ReaderType Reader;
+	TestHandler Handler;
+	for (size_t Count = 0; Count < Handler.Seen.size(); ++Count)
+		Check(Reader.Read(Stream, Handler) == Protocol::Stop);
+	for (auto const Seen : Handler.Seen) Check(Seen == 1);
+	Check(Handler.Sum == 1 + 2 + 3 + 3 + 5 + 6 + 7 + 8 + 9 + 10 + 11 + 12);
+}
+
+static void CheckRejects(void)
+{
+	TestReader Reader;
+	TestHandler Handler;
+
+	// Unknown message in a known version, then an unknown version
+	for (auto const &Header : std::vector<std::array<uint8_t, 2>>{{{1, 2}}, {{3, 0}}, {{0, 6}}})
+	{
+		TestStream Stream;
+		auto Message = TPV1A::Write(1);
+		Message[0] = Header[0];
+		Message[1] = Header[1];
+		Stream.Append(Message);
+		Check(Reader.Read(Stream, Handler) == Protocol::Error);
+	}
+
+	// A partial message waits for the rest
+	TestStream Stream;
+	auto Message = TPV1C::Write(3, "abc");
+	Message.pop_back();
+	Stream.Append(Message);
+	Check(Reader.Read(Stream, Handler) == Protocol::Continue);
+
+	for (auto const Seen : Handler.Seen) Check(Seen == 0);
+}
+
+template <typename ReaderType> static double TimeDispatch(std::vector<uint8_t> const &Message)
+{
+	TestStream Stream;
+	for (size_t Count = 0; Count < 1024; ++Count) Stream.Append(Message);
+	ReaderType Reader;
+	TestHandler Handler;
+	size_t const Count = 4000000;
+	auto const Out = TimePer(Count, [&](size_t) { Reader.Read(Stream, Handler); });
+	Check(Handler.Sum == Count);
+	return Out;
+}
+
+int main(void)
+{
+	CheckDispatch<TestReader>();
+	CheckDispatch<TestChainReader>(); // So both time the same work
+	CheckRejects();
+
+	for (auto const &Message : std::vector<std::pair<char const *, std::vector<uint8_t>>>{
+		{"first", TPV1A::Write(1)}, {"middle", TPV2A::Write(1)}, {"last", TPV3D::Write(1)}})
+	{
+		auto const Chain = TimeDispatch<TestChainReader>(Message.second);
+		auto const Table = TimeDispatch<TestReader>(Message.second);
+		std::printf("Dispatch, %s message: chain %.1f ns, table %.1f ns\n", Message.first, Chain, Table);
+	}
+
+	return TestResult();
+}
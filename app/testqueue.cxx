@@ -0,0 +1,206 @@
+#include "testing.h"
+#include "shared.h"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Stresses MPSCQueue with several producers against a consumer that sleeps when the queue is empty, the way the
+// network and front end threads use it, and checks pushing doesn't allocate while the pool lasts.  Throughput is
+// compared with the mutex and std::queue of std::function the network used before.
+
+static std::atomic<size_t> Allocations{0};
+
+void *operator new(size_t Size)
+{
+	++Allocations;
+	if (auto Out = std::malloc(Size)) return Out;
+	throw std::bad_alloc{};
+}
+
+void operator delete(void *Pointer) noexcept { std::free(Pointer); }
+void operator delete(void *Pointer, size_t) noexcept { std::free(Pointer); }
+
+// The transfer queue before MPSCQueue: every push and every pop takes the lock, and each call is a std::function
+struct LockedQueue
+{
+	std::mutex Mutex;
+	std::queue<std::function<void(void)>> Calls;
+
+	bool Push(std::function<void(void)> &&Call)
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		Calls.push(std::move(Call));
+		return true; // It woke the consumer on every push
+	}
+
+	template <typename CallbackType> size_t Drain(CallbackType &&Callback)
+	{
+		size_t Count = 0;
+		while (true)
+		{
+			Mutex.lock();
+			if (Calls.empty())
+			{
+				Mutex.unlock();
+				return Count;
+			}
+			auto Call = std::move(Calls.front());
+			Calls.pop();
+			Mutex.unlock();
+			Callback(Call);
+			++Count;
+		}
+	}
+};
+
+struct Item
+{
+	uint32_t Producer;
+	uint32_t Sequence;
+};
+
+static void CheckStress(unsigned int ProducerCount, uint32_t PerProducer, uint32_t PoolSize)
+{
+	MPSCQueue<Item> Queue{PoolSize};
+	std::mutex Mutex;
+	std::condition_variable Wake;
+	bool Woken = false;
+
+	std::vector<std::thread> Producers;
+	for (uint32_t Producer = 0; Producer < ProducerCount; ++Producer)
+		Producers.emplace_back([&, Producer](void)
+		{
+			for (uint32_t Sequence = 0; Sequence < PerProducer; ++Sequence)
+			{
+				if (!Queue.Push(Item{Producer, Sequence})) continue;
+				{
+					std::lock_guard<std::mutex> Lock(Mutex);
+					Woken = true;
+				}
+				Wake.notify_one();
+			}
+		});
+
+	// Only sleeps until woken, so a push that wrongly reports a non-empty queue stalls this until the timeout
+	std::vector<uint32_t> Next(ProducerCount, 0);
+	size_t Received = 0;
+	bool Ordered = true;
+	bool Stalled = false;
+	while (Received < size_t{ProducerCount} * PerProducer)
+	{
+		{
+			std::unique_lock<std::mutex> Lock(Mutex);
+			if (!Wake.wait_for(Lock, std::chrono::seconds(10), [&](void) { return Woken; }))
+			{
+				Stalled = true;
+				break;
+			}
+			Woken = false;
+		}
+		Received += Queue.Drain([&](Item const &Got)
+		{
+			if (Got.Sequence != Next[Got.Producer]) Ordered = false;
+			Next[Got.Producer] = Got.Sequence + 1;
+		});
+	}
+	for (auto &Producer : Producers) Producer.join();
+	Check(!Stalled);
+	Check(Ordered);
+	Check(Received == size_t{ProducerCount} * PerProducer);
+	Check(Queue.Drain([](Item const &) {}) == 0);
+}
+
+static void CheckAllocations(void)
+{
+	MPSCQueue<CallT> Queue{64};
+	size_t Calls = 0;
+	std::array<size_t, 4> Capture{{1, 2, 3, 4}};
+	auto const Before = Allocations.load();
+	for (unsigned int Round = 0; Round < 1000; ++Round)
+	{
+		for (unsigned int Index = 0; Index < 64; ++Index)
+			Queue.Push([&Calls, Capture](void) { Calls += Capture[0]; });
+		Queue.Drain([](CallT &Call) { Call(); });
+	}
+	Check(Allocations.load() == Before);
+	Check(Calls == 64 * 1000);
+
+	// Past the pool, pushes fall back to the heap and still come out in order
+	std::vector<unsigned int> Order;
+	for (unsigned int Index = 0; Index < 200; ++Index)
+		Queue.Push([&Order, Index](void) { Order.push_back(Index); });
+	Check(Allocations.load() > Before);
+	Queue.Drain([](CallT &Call) { Call(); });
+	Check(Order.size() == 200);
+	for (unsigned int Index = 0; Index < Order.size(); ++Index) Check(Order[Index] == Index);
+}
+
+// One thread pushing calls with a typical capture and draining every 64
+template <typename QueueType> static double TimePushDrain(void)
+{
+	QueueType Queue;
+	size_t Calls = 0;
+	std::array<void *, 4> Capture{{nullptr, nullptr, nullptr, nullptr}};
+	auto const Out = TimePer(1000000, [&](size_t Index)
+	{
+		Queue.Push([&Calls, Capture](void) { Calls += 1 + (Capture[0] != nullptr); });
+		if (Index % 64 == 63) Queue.Drain([](auto &Call) { Call(); });
+	});
+	Queue.Drain([](auto &Call) { Call(); });
+	Check(Calls == 1000000);
+	return Out;
+}
+
+// Producers push as fast as they can while the consumer drains; ns per call overall
+template <typename QueueType> static double TimeProducers(unsigned int ProducerCount, size_t PerProducer)
+{
+	QueueType Queue;
+	std::atomic<bool> Go{false};
+	std::vector<std::thread> Producers;
+	size_t Calls = 0;
+	for (unsigned int Producer = 0; Producer < ProducerCount; ++Producer)
+		Producers.emplace_back([&](void)
+		{
+			while (!Go) std::this_thread::yield();
+			std::array<void *, 4> Capture{{nullptr, nullptr, nullptr, nullptr}};
+			for (size_t Index = 0; Index < PerProducer; ++Index)
+				Queue.Push([&Calls, Capture](void) { Calls += 1 + (Capture[0] != nullptr); });
+		});
+	auto const Total = ProducerCount * PerProducer;
+	auto const Start = std::chrono::steady_clock::now();
+	Go = true;
+	size_t Received = 0;
+	while (Received < Total)
+	{
+		auto const Count = Queue.Drain([](auto &Call) { Call(); });
+		if (!Count) std::this_thread::yield();
+		Received += Count;
+	}
+	auto const Out = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - Start).count() / Total;
+	for (auto &Producer : Producers) Producer.join();
+	Check(Calls == Total);
+	return Out;
+}
+
+int main(void)
+{
+	CheckAllocations();
+	CheckStress(1, 200000, 256);
+	CheckStress(4, 100000, 256);
+	CheckStress(8, 50000, 16); // Mostly past the pool
+
+	std::printf("Push and drain, one thread: mutex and std::function %.1f ns, MPSCQueue %.1f ns per call\n",
+		TimePushDrain<LockedQueue>(), TimePushDrain<MPSCQueue<CallT>>());
+	for (auto const ProducerCount : {1u, 4u})
+		std::printf("%u producers: mutex and std::function %.1f ns, MPSCQueue %.1f ns per call\n", ProducerCount,
+			TimeProducers<LockedQueue>(ProducerCount, 200000), TimeProducers<MPSCQueue<CallT>>(ProducerCount, 200000));
+
+	return TestResult();
+}
@@ -0,0 +1,230 @@
+#include "testing.h"
+#include "clientcore.h"
+#include "engine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs the drift correction against the null engine the way ClientCore's sync timer does, once a simulated second,
+// and checks the error settles under the target.  Then runs ClientCore itself with a null engine playing off the
+// real clock, so the sync timer, the agreed timeline and the seek threshold are all the real ones.
+
+struct DeferredCalls : CallTransferType
+{
+	std::vector<CallT> Calls;
+
+	void Transfer(CallT &&Call) override { Calls.push_back(std::move(Call)); }
+
+	void Run(void)
+	{
+		auto Running = std::move(Calls);
+		Calls.clear();
+		for (auto &Call : Running) Call();
+	}
+};
+
+static void CheckEngine(void)
+{
+	uint64_t Now = 1000 * 1000;
+	DeferredCalls Transfer;
+	NullEngine Engine{Transfer};
+	Engine.Clock = [&Now](void) { return Now; };
+	Engine.Duration = MediaTimeT(60 * 1000);
+	unsigned int Prerolled = 0, Ended = 0;
+	Engine.PrerolledCallback = [&](void) { ++Prerolled; };
+	Engine.EndCallback = [&](void) { ++Ended; };
+	AudioEngine::Media First, Second;
+
+	Check(*Engine.GetDuration(First) == 60 * 1000);
+	Engine.Play(First, MediaTimeT(50 * 1000));
+	Now += 1000;
+
+	// The current item plays on through the preroll
+	Engine.Preroll(Second, MediaTimeT(0));
+	Check(Prerolled == 0);
+	Transfer.Run();
+	Check(Prerolled == 1);
+	Now += 1000;
+	Check(Engine.IsPlaying());
+	Check(**Engine.GetTime() == 52 * 1000);
+
+	// Released late, from where it should be by now
+	Engine.Release(MediaTimeT(30));
+	Check(Engine.IsPlaying());
+	Check(**Engine.GetTime() == 30);
+	Now += 1000;
+	Check(**Engine.GetTime() == 1030);
+
+	// Stops at the end
+	Now += 60 * 1000;
+	Check(!Engine.IsPlaying());
+	Check(**Engine.GetTime() == 60 * 1000);
+	Transfer.Run();
+	Check(Ended == 1);
+	Check(Transfer.Calls.empty());
+
+	// Released without a preroll does nothing
+	Engine.Release(MediaTimeT(0));
+	Check(!Engine.IsPlaying());
+}
+
+static void CheckConverges(float Skew, int64_t StartError, int64_t Jitter)
+{
+	uint64_t Now = 1000 * 1000;
+	DeferredCalls Transfer;
+	NullEngine Engine{Transfer};
+	Engine.Clock = [&Now](void) { return Now; };
+	Engine.Skew = Skew;
+	AudioEngine::Media Item;
+	auto const Start = Now;
+	Engine.Play(Item, MediaTimeT(static_cast<uint64_t>(10 * 1000 + StartError)));
+
+	DriftCorrector Drift;
+	int64_t Worst = 0;
+	for (unsigned int Second = 0; Second < 120; ++Second)
+	{
+		Now += 1000;
+		auto const Expected = 10 * 1000 + (Now - Start);
+		auto const Error = static_cast<int64_t>(**Engine.GetTime()) - static_cast<int64_t>(Expected);
+		auto const Rate = Drift.Correct(Error + ((Second % 2) ? Jitter : -Jitter));
+		if (!Rate)
+		{
+			Engine.SetRate(1);
+			Engine.Seek(MediaTimeT(Expected));
+		}
+		else Engine.SetRate(*Rate);
+		if (Second >= 30) Worst = std::max(Worst, std::abs(Error));
+	}
+	if (Worst > DriftCorrector::Target)
+		std::fprintf(stderr, "Skew %f, start %dms, jitter %dms: settled %dms off\n", Skew, static_cast<int>(StartError), static_cast<int>(Jitter), static_cast<int>(Worst));
+	Check(Worst <= DriftCorrector::Target);
+}
+
+// A ClientCore playing one item on a null engine that runs slightly fast.  Each play is moved off the agreed
+// timeline right after it starts, like a stall or a skip.  There's one network loop per process, so one client.
+struct ClientRun
+{
+	std::mutex Mutex;
+	std::condition_variable Changed;
+	bool Added = false;
+	bool Stopped = false;
+	int64_t Jump = 0;
+	std::vector<int64_t> Errors;
+	NullEngine *Engine = nullptr;
+	HashT Hash{};
+	ClientCore Client;
+
+	ClientRun(float Skew) : Client{0, [this, Skew](CallTransferType &CallTransfer)
+	{
+		auto Out = std::make_unique<NullEngine>(CallTransfer);
+		Out->Skew = Skew;
+		Engine = Out.get();
+		return std::unique_ptr<AudioEngine>{std::move(Out)};
+	}}
+	{
+		// Callbacks run on the core thread, like the engine
+		Client.AddUpdateCallback = [this](std::vector<MediaInfo>)
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			Added = true;
+			Changed.notify_all();
+		};
+		Client.PlayCallback = [this](void)
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			Engine->Seek(MediaTimeT(static_cast<uint64_t>(static_cast<int64_t>(**Engine->GetTime()) + Jump)));
+		};
+		Client.StopCallback = [this](void)
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			Stopped = true;
+		};
+		Client.SyncCallback = [this](int64_t Error)
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			Errors.push_back(Error);
+		};
+
+		Hash[0] = 1;
+		Client.Add(Hash, 1000, PathT::Qualify("/nonexistent/testsync.ogg"));
+		std::unique_lock<std::mutex> Lock(Mutex);
+		Check(Changed.wait_for(Lock, std::chrono::seconds(10), [this](void) { return Added; }));
+	}
+
+	// Errors at each sync check over Seconds
+	std::vector<int64_t> Play(int64_t Jump, unsigned int Seconds)
+	{
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			this->Jump = Jump;
+			Errors.clear();
+		}
+		Client.Play(Hash, MediaTimeT(10 * 1000));
+		std::this_thread::sleep_for(std::chrono::seconds(Seconds));
+		std::lock_guard<std::mutex> Lock(Mutex);
+		std::fprintf(stderr, "Jumped %dms, sync errors:", static_cast<int>(Jump));
+		for (auto const Error : Errors) std::fprintf(stderr, " %d", static_cast<int>(Error));
+		std::fprintf(stderr, "\n");
+		return Errors;
+	}
+
+	// Errors at each sync check over Seconds after removing the item
+	std::vector<int64_t> Remove(unsigned int Seconds)
+	{
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			Errors.clear();
+		}
+		Client.Remove(Hash);
+		std::this_thread::sleep_for(std::chrono::seconds(Seconds));
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return Errors;
+	}
+};
+
+static void CheckClient(void)
+{
+	ClientRun Run{0.003f};
+
+	// Behind: trimmed back by changing the rate
+	auto Errors = Run.Play(-100, 10);
+	Check(Errors.size() >= 8);
+	if (Errors.size() >= 8)
+	{
+		Check(Errors.front() < -DriftCorrector::Target);
+		Check(Errors.front() >= -DriftCorrector::SeekThreshold);
+		for (size_t Index = Errors.size() - 2; Index < Errors.size(); ++Index)
+			Check(std::abs(Errors[Index]) <= DriftCorrector::Target);
+	}
+
+	// Far ahead: past the seek threshold, so it's back right after the first check.  The earlier play's sync
+	// checks have to stop, or they'd show up here too.
+	Errors = Run.Play(1000, 4);
+	Check((Errors.size() >= 2) && (Errors.size() <= 4));
+	if (Errors.size() >= 2)
+	{
+		Check(Errors.front() > DriftCorrector::SeekThreshold);
+		for (size_t Index = 1; Index < Errors.size(); ++Index) Check(std::abs(Errors[Index]) <= DriftCorrector::Target);
+	}
+
+	// Removing the playing item stops it, and the sync checks with it, rather than leaving them reading the freed item
+	Errors = Run.Remove(2);
+	Check(Errors.empty());
+	std::lock_guard<std::mutex> Lock(Run.Mutex);
+	Check(Run.Stopped);
+}
+
+int main(void)
+{
+	CheckEngine();
+	for (auto const Skew : {0.0f, 0.0001f, -0.0001f, 0.001f, -0.001f})
+		for (auto const StartError : {0, 40, -40, 200, -200, 1000})
+			for (auto const Jitter : {0, 3})
+				CheckConverges(Skew, StartError, Jitter);
+	CheckClient();
+	return TestResult();
+}